@@ -0,0 +1,235 @@
+/*===========================================
+ Assignment 4: Emulating End-to-End Reliable Flow Control
+ Name: Aritra Maji
+ Roll number: 22CS30011
+============================================*/
+
+#include <math.h>
+#include "ksocket.h"
+
+#define CUBIC_C 0.4      // CUBIC scaling constant (messages / s^3)
+#define CUBIC_BETA 0.7   // CUBIC multiplicative decrease factor
+
+/* Each algorithm only decides how the window grows and how far it is cut on a
+ * loss. Slow start, duplicate ACK counting, fast recovery and timeouts are the
+ * same for all of them and are handled by the cc_* functions below. */
+struct cc_ops {
+    const char *name;
+    int inflate;         // 1 to inflate the window by each duplicate ACK during recovery
+    void (*init)(struct cong_info *cc);
+    void (*increase)(struct cong_info *cc, int acked, int64_t srtt);  // Congestion avoidance
+    int (*reduce)(struct cong_info *cc, int flight);                  // New ssthresh after a loss
+};
+
+// Local helper function prototypes
+static void reno_init(struct cong_info *cc);
+static void aimd_init(struct cong_info *cc);
+static void reno_increase(struct cong_info *cc, int acked, int64_t srtt);
+static void cubic_increase(struct cong_info *cc, int acked, int64_t srtt);
+static int reno_reduce(struct cong_info *cc, int flight);
+static int aimd_reduce(struct cong_info *cc, int flight);
+static int cubic_reduce(struct cong_info *cc, int flight);
+
+static const struct cc_ops cc_algorithms[CC_COUNT] = {
+    [CC_NONE]    = { "none",    0, reno_init, reno_increase,  reno_reduce },
+    [CC_AIMD]    = { "aimd",    0, aimd_init, reno_increase,  aimd_reduce },
+    [CC_NEWRENO] = { "newreno", 1, reno_init, reno_increase,  reno_reduce },
+    [CC_CUBIC]   = { "cubic",   1, reno_init, cubic_increase, cubic_reduce },
+};
+
+// Slow start from INITIAL_CWND until the first loss
+static void reno_init(struct cong_info *cc) {
+    cc->ssthresh = MAX_BUFFER_SIZE;
+}
+
+// Plain AIMD has no slow start: additive increase from the first message
+static void aimd_init(struct cong_info *cc) {
+    cc->ssthresh = cc->cwnd;
+}
+
+// One more message per window of acknowledged messages, about +1 per RTT
+static void reno_increase(struct cong_info *cc, int acked, int64_t srtt) {
+    cc->cwnd_cnt += acked;
+    if (cc->cwnd_cnt >= cc->cwnd) {
+        cc->cwnd_cnt -= cc->cwnd;
+        cc->cwnd++;
+    }
+}
+
+// Grow toward W(t) = C * (t - K)^3 + w_max, evaluated one RTT ahead
+static void cubic_increase(struct cong_info *cc, int acked, int64_t srtt) {
+    int64_t now = monotonic_ns();
+    if (cc->epoch_start == 0) {
+        // First increase since the last reduction
+        cc->epoch_start = now;
+        if (cc->w_max < cc->cwnd) {
+            cc->w_max = cc->cwnd;
+        }
+        cc->cubic_k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+        cc->cwnd_cnt = 0;
+    }
+
+    double elapsed = (double)(now - cc->epoch_start + srtt) / NSEC_PER_SEC - cc->cubic_k;
+    double target = CUBIC_C * elapsed * elapsed * elapsed + cc->w_max;
+
+    // Acknowledged messages needed for +1; grow very slowly while above the curve
+    int needed = (target > cc->cwnd) ? (int)(cc->cwnd / (target - cc->cwnd)) : 100 * cc->cwnd;
+    needed = (needed < 1) ? 1 : needed;
+
+    cc->cwnd_cnt += acked;
+    if (cc->cwnd_cnt >= needed) {
+        cc->cwnd_cnt = 0;
+        cc->cwnd++;
+    }
+}
+
+// Half of the data in flight (RFC 5681)
+static int reno_reduce(struct cong_info *cc, int flight) {
+    return (flight / 2 > 2) ? flight / 2 : 2;
+}
+
+// Half of the current window
+static int aimd_reduce(struct cong_info *cc, int flight) {
+    return (cc->cwnd / 2 > 1) ? cc->cwnd / 2 : 1;
+}
+
+// Multiply by CUBIC_BETA and restart the cubic curve from the window at the loss
+static int cubic_reduce(struct cong_info *cc, int flight) {
+    // Fast convergence: give up more bandwidth if the window did not reach w_max again
+    if (cc->cwnd < cc->w_max) {
+        cc->w_max = (int)(cc->cwnd * (1.0 + CUBIC_BETA) / 2.0);
+    } else {
+        cc->w_max = cc->cwnd;
+    }
+    cc->epoch_start = 0;
+
+    int ssthresh = (int)(cc->cwnd * CUBIC_BETA);
+    return (ssthresh > 2) ? ssthresh : 2;
+}
+
+// Name of an algorithm for reports, "unknown" if it is out of range
+const char *cc_name(int algorithm) {
+    if (algorithm < 0 || algorithm >= CC_COUNT) {
+        return "unknown";
+    }
+    return cc_algorithms[algorithm].name;
+}
+
+// Start an algorithm from scratch; high_seq is left to the caller
+void cc_init(struct cong_info *cc, int algorithm) {
+    cc->algorithm = algorithm;
+    cc->cwnd = INITIAL_CWND;
+    cc->cwnd_cnt = 0;
+    cc->dupacks = 0;
+    cc->in_recovery = 0;
+    cc->recover = cc->high_seq;
+    cc->w_max = 0;
+    cc->cubic_k = 0;
+    cc->epoch_start = 0;
+    cc->created = monotonic_ns();
+    cc->delivered = 0;
+    cc->reported = 0;
+    cc->loss_events = 0;
+    cc->timeouts = 0;
+    cc_algorithms[algorithm].init(cc);
+}
+
+// Messages from swnd.start the congestion window allows in flight
+int cc_window(const struct cong_info *cc) {
+    if (cc->algorithm == CC_NONE) {
+        return MAX_BUFFER_SIZE;
+    }
+    return cc->cwnd;
+}
+
+// Record that a message has been put on the wire
+void cc_on_sent(struct cong_info *cc, uint32_t seq_num) {
+    if (SEQ_DIFF(seq_num + 1, cc->high_seq) > 0) {
+        cc->high_seq = seq_num + 1;
+    }
+}
+
+// Cut the window once per window of data; inflate is set when duplicate ACKs found the loss
+static void enter_recovery(struct cong_info *cc, uint32_t snd_una, int inflate) {
+    const struct cc_ops *ops = &cc_algorithms[cc->algorithm];
+    if (cc->in_recovery || SEQ_DIFF(snd_una, cc->recover) < 0) {
+        return;  // Already reduced for a loss in this window
+    }
+
+    cc->loss_events++;
+    cc->ssthresh = ops->reduce(cc, SEQ_DIFF(cc->high_seq, snd_una));
+    cc->cwnd = cc->ssthresh + ((inflate && ops->inflate) ? DUPACK_THRESHOLD : 0);
+    cc->cwnd_cnt = 0;
+    cc->in_recovery = 1;
+    cc->recover = cc->high_seq;
+}
+
+/* Update the window for an ACK. acked is the number of messages swnd.start moved
+ * over (snd_una is the new swnd.start) and sacked the number of messages it
+ * selectively acknowledged for the first time. An ACK that acknowledges nothing
+ * new cumulatively but reports newly received data is a duplicate ACK. */
+void cc_on_ack(struct cong_info *cc, uint32_t snd_una, int acked, int sacked, int64_t srtt) {
+    const struct cc_ops *ops = &cc_algorithms[cc->algorithm];
+    cc->delivered += acked;
+
+    if (acked == 0) {
+        if (sacked == 0) {
+            return;  // Window update only
+        }
+        cc->dupacks++;
+        if (cc->in_recovery) {
+            // Another message has left the network
+            cc->cwnd += ops->inflate;
+        } else if (cc->dupacks == DUPACK_THRESHOLD) {
+            enter_recovery(cc, snd_una, 1);
+        }
+        return;
+    }
+    cc->dupacks = 0;
+
+    if (cc->in_recovery) {
+        if (SEQ_DIFF(snd_una, cc->recover) >= 0) {
+            // Full ACK: everything outstanding at the loss is acknowledged
+            cc->in_recovery = 0;
+            cc->cwnd = cc->ssthresh;
+        } else if (ops->inflate) {
+            // Partial ACK: deflate by the acknowledged messages, then allow one more
+            cc->cwnd -= acked - 1;
+            cc->cwnd = (cc->cwnd < 1) ? 1 : cc->cwnd;
+        }
+        return;
+    }
+
+    if (cc->cwnd < cc->ssthresh) {
+        // Slow start
+        cc->cwnd += acked;
+        cc->cwnd = (cc->cwnd > cc->ssthresh) ? cc->ssthresh : cc->cwnd;
+    } else {
+        ops->increase(cc, acked, srtt);
+    }
+
+    // Never grow beyond what any send buffer could fill
+    cc->cwnd = (cc->cwnd > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : cc->cwnd;
+}
+
+// A message other than the oldest timed out: treat it like duplicate ACKs would
+void cc_on_loss(struct cong_info *cc, uint32_t snd_una) {
+    enter_recovery(cc, snd_una, 0);
+}
+
+// The oldest message timed out: slow start again from one message
+void cc_on_timeout(struct cong_info *cc, uint32_t snd_una) {
+    const struct cc_ops *ops = &cc_algorithms[cc->algorithm];
+
+    // Repeated timeouts, or a timeout during recovery, keep the ssthresh already set
+    if (SEQ_DIFF(snd_una, cc->recover) >= 0) {
+        cc->ssthresh = ops->reduce(cc, SEQ_DIFF(cc->high_seq, snd_una));
+        cc->loss_events++;
+    }
+    cc->timeouts++;
+    cc->cwnd = 1;
+    cc->cwnd_cnt = 0;
+    cc->dupacks = 0;
+    cc->in_recovery = 0;
+    cc->recover = cc->high_seq;
+}
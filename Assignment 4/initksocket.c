@@ -4,32 +4,284 @@
  Roll number: 22CS30011
 ============================================*/
 
+#define _GNU_SOURCE       // semtimedop(), recvmmsg(), sendmmsg(), pthread_setaffinity_np()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <signal.h>
 #include <pthread.h>
 #include "ksocket.h"
 
+// Packets staged under a socket lock and sent after the lock is released
+struct tx_batch {
+    int sock_id;                  // UDP socket to send on
+    int sock_index;               // KTP socket the packets belong to
+    struct sockaddr_in dest_addr; // Bound destination
+    int count;                    // Number of staged packets
+    int64_t next_deadline;        // Earliest retransmission timer of the socket (ns)
+    int ack_len;                  // Length of a staged window update or delayed ACK, 0 if none
+    char ack_packet[MAX_ACK_SIZE];
+    uint32_t seqs[MAX_BUFFER_SIZE];  // Sequence number of each staged packet
+    int lengths[MAX_BUFFER_SIZE];    // Wire length of each staged packet
+    char *packets[MAX_BUFFER_SIZE];  // Send slot of each staged packet, header filled in
+    struct iovec iovs[MAX_BUFFER_SIZE + 1];     // Window update first, then the packets
+    struct mmsghdr msgs[MAX_BUFFER_SIZE + 1];
+};
+
+#define IMPAIRED_BATCH (2 * RECV_BATCH)  // Most messages of a received batch once the impairment duplicated them
+#define RELEASE_EVENT UINT32_MAX         // KTP socket index in the epoll event of a worker's timer_fd
+
+// A received packet the impairment stage holds back until its release time
+struct held_packet {
+    int64_t release;              // CLOCK_MONOTONIC ns when R() processes it
+    uint64_t order;               // Packets released at the same time keep the order they were held in
+    int sock_index;               // KTP socket that received it
+    int udp_sockid;               // UDP socket it arrived on
+    struct sockaddr_in src_addr;  // Sender
+    socklen_t addr_len;
+    int len;                      // Length of the packet in data
+    char data[HEADER_SIZE + MAX_MSG_SIZE + 1];
+};
+
+/* Per-packet traces, off unless initksocket is started with -v. Most of them are made
+ * with a socket lock held, so they slow the daemon down and are for debugging only;
+ * socket set-up, GC and the periodic reports are always printed */
+static int verbose = 0;
+#define TRACE(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+
 // Local helper function prototypes 
 static void initialize_ipc_resources(void);
 static void cleanup_ipc_resources(void);
-static void encode_sequence(char *buffer, int seq_num);
-static void encode_window_size(char *buffer, int window_size);
-static int extract_sequence(const char *buffer);
-static int extract_data_length(const char *buffer);
-static int extract_window_size(const char *buffer);
-static void send_ack_message(int sock_id, int seq, int window_size, struct sockaddr_in *addr);
-static void process_data_message(int sock_index, char *buffer, int msg_len, struct sockaddr_in *addr);
-static void process_ack_message(int sock_index, char *buffer);
-static void retransmit_packets(int sock_index);
-static void transmit_new_packets(int sock_index);
+static void encode_header(char *buffer, uint8_t type, uint32_t seq, int length, int window_size);
+static int decode_header(const char *buffer, int msg_len, KTP_HEADER *header);
+static int build_ack_message(int sock_index, SOCKET_BUFFERS *bufs, char *ack_packet);
+static void prepare_message(struct mmsghdr *msg, struct iovec *iov, void *data, int len,
+                            struct sockaddr_in *addr, socklen_t addr_len);
+static void send_messages(int sock_id, struct mmsghdr *msgs, int count);
+static int process_data_message(int sock_index, const KTP_HEADER *header, const char *payload, char *ack_packet);
+static int process_ack_message(int sock_index, const KTP_HEADER *header, const char *payload);
+static int retransmit_packets(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch);
+static void transmit_new_packets(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch);
+static void flush_tx_batch(struct tx_batch *batch);
+
+/* The sockets are sharded across workers, each an R() and an S() thread pinned
+ * to the same core that serve only the sockets whose sock_info.worker names
+ * them. Workers share nothing but the socket locks of sockets they do not own,
+ * so the daemon's packet rate grows with their number. */
+struct worker {
+    int index;                    // sock_info.worker of the sockets it serves
+    int cpu;                      // Core both threads are pinned to
+    pthread_t receiver_thread, sender_thread;
+    
+    // Every bound UDP socket of the worker is registered here; the event data carries
+    // the fd in the upper and the KTP socket index in the lower 32 bits
+    int epoll_fd;
+    
+    // R(): incoming messages and outgoing ACKs, reused across iterations
+    char message_buffers[RECV_BATCH][HEADER_SIZE + MAX_MSG_SIZE + 1];
+    struct sockaddr_in src_addrs[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    char ack_packets[IMPAIRED_BATCH][MAX_ACK_SIZE];
+    struct iovec ack_iovs[IMPAIRED_BATCH];
+    struct mmsghdr acks[IMPAIRED_BATCH];
+    
+    // R(): packets the impairment stage holds back, a min-heap of slots of held ordered
+    // by release time; timer_fd, registered in epoll_fd, expires at the earliest
+    int timer_fd;
+    int64_t timer_due;            // Release time timer_fd is armed for, 0 if disarmed
+    struct held_packet held[IMPAIR_QUEUE_SIZE];
+    int held_heap[IMPAIR_QUEUE_SIZE];
+    int held_count;               // Packets in held_heap
+    int free_held[IMPAIR_QUEUE_SIZE];  // Slots of held not in use
+    int free_count;
+    uint64_t held_order;          // order of the next held packet
+    
+    // S(): staging area for one socket's packets, reused across sockets
+    struct tx_batch batch;
+};
 
 // Global thread variables to properly terminate threads
-pthread_t receiver_thread, sender_thread, gc_thread;
+static struct worker workers[MAX_WORKERS];
+static int worker_count = 1;
+pthread_t gc_thread;
 volatile sig_atomic_t terminate_flag = 0;
 
+// Pick the worker serving the fewest sockets for a new one
+static int least_loaded_worker(int sock_index) {
+    int load[MAX_WORKERS] = {0};
+    for (int socket_idx = 0; socket_idx < N; socket_idx++) {
+        if (socket_idx == sock_index) {
+            continue;
+        }
+        lock_socket(socket_idx);
+        if (!shared_mem[socket_idx].sock_info.free) {
+            load[shared_mem[socket_idx].sock_info.worker]++;
+        }
+        unlock_socket(socket_idx);
+    }
+    
+    int best = 0;
+    for (int worker_idx = 1; worker_idx < worker_count; worker_idx++) {
+        best = (load[worker_idx] < load[best]) ? worker_idx : best;
+    }
+    return best;
+}
+
+// Handle a CREATE_REQUEST: make the buffer segment and the UDP socket, filling in the reply,
+// and give the socket to a worker
+static void create_socket(int sock_index, NET_SOCKET *request) {
+    // Create the buffer segment first so that a failure leaves nothing behind
+    size_t buf_bytes = socket_buffers_size(request->send_size, request->recv_size, 0);
+    int buf_shmid = shmget(IPC_PRIVATE, buf_bytes, 0666 | IPC_CREAT);
+    if (buf_shmid < 0) {
+        fprintf(stderr, "Failed to create socket buffers: %s\n", strerror(errno));
+        request->sock_id = -1;
+        request->err_code = errno;
+        return;
+    }
+    
+    // Create new UDP socket
+    printf("Creating new UDP socket\n");
+    int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sock < 0) {
+        fprintf(stderr, "Failed to create UDP socket: %s\n", strerror(errno));
+        request->sock_id = -1;
+        request->err_code = errno;
+        shmctl(buf_shmid, IPC_RMID, NULL);
+    } else {
+        request->sock_id = udp_sock;
+        request->buf_shmid = buf_shmid;
+        
+        // The worker stays with the socket until it is closed
+        int worker_idx = least_loaded_worker(sock_index);
+        lock_socket(sock_index);
+        socket_state(sock_index)->sock_info.worker = worker_idx;
+        unlock_socket(sock_index);
+        printf("Created UDP socket with ID: %d and %zu bytes of buffers (send %d, receive %d) for worker %d\n",
+               udp_sock, buf_bytes, request->send_size, request->recv_size, worker_idx);
+    }
+}
+
+// Bind the UDP socket of a BIND_REQUEST to the requested address, filling in the reply
+static void bind_udp_socket(int sock_index, NET_SOCKET *request) {
+    // Bind existing socket to address
+    printf("Binding socket %d to %s:%d\n", request->sock_id, 
+           request->ip_addr, request->port);
+           
+    // Prepare address structure
+    struct sockaddr_in bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_port = htons(request->port);
+    
+    // Convert IP string to network format
+    if (inet_pton(AF_INET, request->ip_addr, &(bind_addr.sin_addr)) <= 0) {
+        fprintf(stderr, "Invalid IP address format: %s\n", request->ip_addr);
+        request->sock_id = -1;
+        request->err_code = EINVAL;
+        return;
+    }
+    
+    // Perform the bind operation
+    if (bind(request->sock_id, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) < 0) {
+        fprintf(stderr, "Failed to bind socket: %s\n", strerror(errno));
+        request->sock_id = -1;
+        request->err_code = errno;
+        return;
+    }
+    printf("Successfully bound socket %d to %s:%d\n", 
+           request->sock_id, request->ip_addr, request->port);
+    
+    // Only a bound socket has a peer to receive from; its worker's R() picks it up immediately
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)request->sock_id << 32) | (uint32_t)sock_index;
+    int epoll_fd = workers[socket_state(sock_index)->sock_info.worker].epoll_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, request->sock_id, &event) < 0) {
+        fprintf(stderr, "Failed to register socket %d with epoll: %s\n", request->sock_id, strerror(errno));
+        request->sock_id = -1;
+        request->err_code = errno;
+    }
+}
+
+// Handle a BIND_REQUEST. An unconnected socket is also given a new buffer segment with
+// room for its peers, which k_bind swaps in for the one it was created with
+static void bind_socket(int sock_index, NET_SOCKET *request) {
+    request->buf_shmid = -1;
+    if (request->unconnected) {
+        lock_socket(sock_index);
+        int send_size = socket_state(sock_index)->send_info.size;
+        int recv_size = socket_state(sock_index)->recv_info.size;
+        unlock_socket(sock_index);
+        size_t buf_bytes = socket_buffers_size(send_size, recv_size, 1);
+        request->buf_shmid = shmget(IPC_PRIVATE, buf_bytes, 0666 | IPC_CREAT);
+        if (request->buf_shmid < 0) {
+            fprintf(stderr, "Failed to create peer buffers: %s\n", strerror(errno));
+            request->sock_id = -1;
+            request->err_code = errno;
+            return;
+        }
+        printf("Created %zu bytes of buffers for up to %d peers of KTP socket %d\n",
+               buf_bytes, MAX_PEERS, sock_index);
+    }
+    
+    bind_udp_socket(sock_index, request);
+    if (request->sock_id < 0 && request->buf_shmid >= 0) {
+        shmctl(request->buf_shmid, IPC_RMID, NULL);
+        request->buf_shmid = -1;
+    }
+}
+
+// Handle a CLOSE_REQUEST: detach the UDP socket from its KTP socket, then close it
+static void close_socket(int sock_index, NET_SOCKET *request) {
+    // R() and S() look the descriptor up under the socket lock and skip it from now on.
+    // An ACK still held back would never be sent, leaving the peer to linger for it
+    char ack_packet[MAX_ACK_SIZE];
+    int ack_len = 0;
+    struct sockaddr_in dest_addr;
+    lock_socket(sock_index);
+    if (socket_state(sock_index)->sock_info.udp_sockid == request->sock_id) {
+        socket_state(sock_index)->sock_info.udp_sockid = -1;
+        SOCKET_BUFFERS *bufs = socket_buffers(sock_index);
+        if (bufs != NULL && socket_state(sock_index)->ack.due != 0) {
+            ack_len = build_ack_message(sock_index, bufs, ack_packet);
+            memset(&dest_addr, 0, sizeof(dest_addr));
+            dest_addr.sin_family = AF_INET;
+            dest_addr.sin_port = htons(socket_state(sock_index)->sock_info.port);
+            inet_pton(AF_INET, socket_state(sock_index)->sock_info.ip_addr, &dest_addr.sin_addr);
+        }
+    }
+    unlock_socket(sock_index);
+    if (ack_len > 0) {
+        sendto(request->sock_id, ack_packet, ack_len, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    }
+    
+    // Unbound sockets were never registered; ENOENT is expected for them
+    epoll_ctl(workers[socket_state(sock_index)->sock_info.worker].epoll_fd, EPOLL_CTL_DEL,
+              request->sock_id, NULL);
+    if (close(request->sock_id) < 0) {
+        request->err_code = errno;
+        request->sock_id = -1;
+    } else {
+        printf("Closed UDP socket %d of KTP socket %d\n", request->sock_id, sock_index);
+    }
+}
+
+// Slot of the oldest pending request, -1 if none (caller holds semid_net_socket)
+static int oldest_pending_request(void) {
+    int oldest = -1;
+    for (int slot_idx = 0; slot_idx < N; slot_idx++) {
+        NET_SOCKET *slot = &request_queue->requests[slot_idx];
+        if (slot->state == REQUEST_PENDING &&
+            (oldest < 0 || SEQ_DIFF(slot->ticket, request_queue->requests[oldest].ticket) < 0)) {
+            oldest = slot_idx;
+        }
+    }
+    return oldest;
+}
+
 // Function to create and bind UDP sockets as requested by k_socket and k_bind
 void create_and_bind() {
     printf("Starting socket handler thread\n");
@@ -37,55 +289,76 @@ void create_and_bind() {
     while(1) {
         // Wait for a socket request from KTP library
         P(semid_init);
+        
+        // Take the oldest request out of the queue; the queue stays open to other
+        // processes while the socket calls are made
         P(semid_net_socket);
+        int slot_idx = oldest_pending_request();
+        if (slot_idx < 0) {
+            V(semid_net_socket);
+            continue;
+        }
+        NET_SOCKET request = request_queue->requests[slot_idx];
+        request_queue->requests[slot_idx].state = REQUEST_BUSY;
+        V(semid_net_socket);
         
-        // Check if this is a socket creation or a bind request
-        if (net_socket->sock_id == 0 && net_socket->port == 0) {
-            // Create new UDP socket
-            printf("Creating new UDP socket\n");
-            int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-            if (udp_sock < 0) {
-                fprintf(stderr, "Failed to create UDP socket: %s\n", strerror(errno));
-                net_socket->sock_id = -1;
-                net_socket->err_code = errno;
-            } else {
-                net_socket->sock_id = udp_sock;
-                printf("Created UDP socket with ID: %d\n", udp_sock);
-            }
+        if (request.type == CREATE_REQUEST) {
+            create_socket(slot_idx, &request);
+        } else if (request.type == BIND_REQUEST) {
+            bind_socket(slot_idx, &request);
+        } else if (request.type == CLOSE_REQUEST) {
+            close_socket(slot_idx, &request);
         } else {
-            // Bind existing socket to address
-            printf("Binding socket %d to %s:%d\n", net_socket->sock_id, 
-                   net_socket->ip_addr, net_socket->port);
-                   
-            // Prepare address structure
-            struct sockaddr_in bind_addr;
-            memset(&bind_addr, 0, sizeof(bind_addr));
-            bind_addr.sin_family = AF_INET;
-            bind_addr.sin_port = htons(net_socket->port);
-            
-            // Convert IP string to network format
-            if (inet_pton(AF_INET, net_socket->ip_addr, &(bind_addr.sin_addr)) <= 0) {
-                fprintf(stderr, "Invalid IP address format: %s\n", net_socket->ip_addr);
-                net_socket->sock_id = -1;
-                net_socket->err_code = EINVAL;
-                V(semid_net_socket);
-                V(semid_ktp);
-                continue;
-            }
-            
-            // Perform the bind operation
-            if (bind(net_socket->sock_id, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) < 0) {
-                fprintf(stderr, "Failed to bind socket: %s\n", strerror(errno));
-                net_socket->sock_id = -1;
-                net_socket->err_code = errno;
-            } else {
-                printf("Successfully bound socket %d to %s:%d\n", 
-                       net_socket->sock_id, net_socket->ip_addr, net_socket->port);
-            }
+            request.sock_id = -1;
+            request.err_code = EINVAL;
         }
         
+        // Store the reply and wake only the process that queued the request
+        P(semid_net_socket);
+        request.state = REQUEST_DONE;
+        request_queue->requests[slot_idx] = request;
         V(semid_net_socket);
-        V(semid_ktp);
+        complete_request(slot_idx);
+    }
+}
+
+// Clear the request slot of a socket whose owner has died; returns -1 if the request is
+// still queued or being handled. A create reply that was never collected hands its UDP
+// socket and buffer segment over to the caller, a bind reply its peer buffer segment
+// (caller holds the socket lock)
+static int collect_orphaned_request(int sock_index, int *udp_sockid, int *buf_shmid, int *bind_shmid) {
+    P(semid_net_socket);
+    NET_SOCKET *slot = &request_queue->requests[sock_index];
+    if (slot->state == REQUEST_PENDING || slot->state == REQUEST_BUSY) {
+        V(semid_net_socket);
+        return -1;
+    }
+    if (slot->state == REQUEST_DONE) {
+        if (slot->type == CREATE_REQUEST && slot->sock_id >= 0) {
+            *udp_sockid = slot->sock_id;
+            *buf_shmid = slot->buf_shmid;
+        } else if (slot->type == BIND_REQUEST && slot->sock_id >= 0) {
+            *bind_shmid = slot->buf_shmid;
+        }
+        slot->state = REQUEST_EMPTY;
+        semctl(semid_ktp, sock_index, SETVAL, 0);  // Nobody is left to wait for the reply
+    }
+    V(semid_net_socket);
+    return 0;
+}
+
+// Forget the peers of socket_idx that have been idle for PEER_IDLE_TIMEOUT, so that a
+// long-running unconnected socket does not run out of peer entries
+static void expire_idle_peers(int socket_idx) {
+    int expired = 0, left = 0;
+    lock_socket(socket_idx);
+    if (!shared_mem[socket_idx].sock_info.free && shared_mem[socket_idx].sock_info.unconnected) {
+        expired = expire_peers(socket_idx, monotonic_ns());
+        left = shared_mem[socket_idx].sock_info.peers - shared_mem[socket_idx].sock_info.free_peers;
+    }
+    unlock_socket(socket_idx);
+    if (expired > 0) {
+        printf("GC: Expired %d idle peers of socket %d, %d left\n", expired, socket_idx, left);
     }
 }
 
@@ -97,466 +370,1412 @@ void *GC() {
         // Run garbage collection periodically
         sleep(T);
         
-        P(semid_shared_mem);
         for (int socket_idx = 0; socket_idx < N; socket_idx++) {
-            if (shared_mem[socket_idx].sock_info.free == 0) {
-                // Check if the process that created this socket still exists
-                if (kill(shared_mem[socket_idx].sock_info.pid, 0) == -1 && errno == ESRCH) {
-                    // Process doesn't exist anymore, free the socket resources
-                    printf("GC: Process %d not found, freeing socket %d\n", 
-                           shared_mem[socket_idx].sock_info.pid, socket_idx);
-                    shared_mem[socket_idx].sock_info.free = 1;
-                    
-                    // Close the UDP socket if it's open
-                    if (shared_mem[socket_idx].sock_info.udp_sockid > 0) {
-                        close(shared_mem[socket_idx].sock_info.udp_sockid);
-                        printf("GC: Closed UDP socket %d\n", shared_mem[socket_idx].sock_info.udp_sockid);
+            // Snapshot the owner without holding the lock across kill()
+            lock_socket(socket_idx);
+            int in_use = !shared_mem[socket_idx].sock_info.free;
+            pid_t owner = shared_mem[socket_idx].sock_info.pid;
+            unlock_socket(socket_idx);
+            
+            // Check if the process that created this socket still exists
+            if (!in_use) {
+                continue;
+            }
+            if (kill(owner, 0) == 0 || errno != ESRCH) {
+                expire_idle_peers(socket_idx);
+                continue;
+            }
+            
+            // Process doesn't exist anymore, free the socket unless it was reused meanwhile
+            // or its last request is still in the queue (then the next round frees it)
+            int udp_sockid = -1, buf_shmid = -1, bind_shmid = -1;
+            P(semid_alloc);
+            lock_socket(socket_idx);
+            int epoll_fd = workers[shared_mem[socket_idx].sock_info.worker].epoll_fd;
+            if (!shared_mem[socket_idx].sock_info.free && shared_mem[socket_idx].sock_info.pid == owner) {
+                udp_sockid = shared_mem[socket_idx].sock_info.udp_sockid;
+                buf_shmid = shared_mem[socket_idx].sock_info.buf_shmid;
+                if (collect_orphaned_request(socket_idx, &udp_sockid, &buf_shmid, &bind_shmid) == 0) {
+                    if (shared_mem[socket_idx].sock_info.unconnected) {
+                        release_peers(socket_idx);
                     }
+                    shared_mem[socket_idx].sock_info.free = 1;
+                    release_socket_buffers(socket_idx);
+                } else {
+                    udp_sockid = -1;
+                    buf_shmid = -1;
                 }
             }
+            unlock_socket(socket_idx);
+            V(semid_alloc);
+            
+            if (udp_sockid < 0 && buf_shmid < 0) {
+                continue;
+            }
+            printf("GC: Process %d not found, freeing socket %d\n", owner, socket_idx);
+            
+            // Remove the buffer segments; each is freed once nobody is attached
+            if (buf_shmid >= 0) {
+                shmctl(buf_shmid, IPC_RMID, NULL);
+            }
+            if (bind_shmid >= 0) {
+                shmctl(bind_shmid, IPC_RMID, NULL);
+            }
+            
+            // Close the UDP socket if it's open
+            if (udp_sockid > 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, udp_sockid, NULL);
+                close(udp_sockid);
+                printf("GC: Closed UDP socket %d\n", udp_sockid);
+            }
         }
-        V(semid_shared_mem);
     }
     
     return NULL;
 }
 
-// Helper function to encode sequence number in binary format
-static void encode_sequence(char *buffer, int seq_num) {
-    // Convert sequence number to binary (8 bits)
-    for (int i = 0; i < 8; i++) {
-        buffer[8 - i - 1] = '0' + ((seq_num >> i) & 1);
-    }
+// Write a packet header with every field in network byte order
+static void encode_header(char *buffer, uint8_t type, uint32_t seq, int length, int window_size) {
+    KTP_HEADER header;
+    header.version = KTP_VERSION;
+    header.type = type;
+    header.length = htons(length);
+    header.seq = htonl(seq);
+    header.window = htonl(window_size);
+    memcpy(buffer, &header, HEADER_SIZE);
 }
 
-// Helper function to encode window size in binary format
-static void encode_window_size(char *buffer, int window_size) {
-    // Convert window size to binary (4 bits)
-    for (int i = 0; i < 4; i++) {
-        buffer[4 - i - 1] = '0' + ((window_size >> i) & 1);
+// Parse and validate a packet header; returns 0 on success, -1 if the packet is dropped
+static int decode_header(const char *buffer, int msg_len, KTP_HEADER *header) {
+    if (msg_len < 1) {
+        return -1;
+    }
+    
+    // Version 1 daemons start every packet with an ASCII '0' or '1'
+    if (buffer[0] == '0' || buffer[0] == '1') {
+        TRACE("R: Dropped packet from a version 1 (ASCII header) KTP peer\n");
+        return -1;
+    }
+    if (msg_len < HEADER_SIZE || (uint8_t)buffer[0] != KTP_VERSION) {
+        TRACE("R: Dropped packet with unsupported KTP version %d\n", (uint8_t)buffer[0]);
+        return -1;
+    }
+    
+    // Copy out once so that every field is a single aligned load
+    memcpy(header, buffer, HEADER_SIZE);
+    header->length = ntohs(header->length);
+    header->seq = ntohl(header->seq);
+    header->window = ntohl(header->window);
+    
+    if (header->length > msg_len - HEADER_SIZE ||
+        (header->type == DATA_MSG && header->length > MAX_MSG_SIZE) ||
+        (header->type == ACK_MSG && header->length % sizeof(SACK_BLOCK) != 0)) {
+        TRACE("R: Dropped malformed packet seq=%u len=%d\n", header->seq, header->length);
+        return -1;
     }
+    return 0;
 }
 
-// Helper function to extract sequence number from binary format
-static int extract_sequence(const char *buffer) {
-    int seq = 0;
-    for (int i = 1; i <= 8; i++) {
-        seq = (seq << 1) | (buffer[i] - '0');
+// Build an ACK for the highest consecutive received packet, followed by SACK blocks for
+// the out-of-order messages held in the receive buffer; returns the packet length
+static int build_ack_message(int sock_index, SOCKET_BUFFERS *bufs, char *ack_packet) {
+    uint32_t next_expected = socket_state(sock_index)->rwnd.start;
+    int mask = socket_state(sock_index)->recv_info.size - 1;
+    int block_count = 0;
+    SACK_BLOCK block;
+    
+    // next_expected itself is missing, so every held message after it, up to the highest
+    // one received, is out of order; in-order traffic has none to look at
+    int span = SEQ_DIFF(socket_state(sock_index)->ack.high_seq, next_expected) - 1;
+    span = (span > mask) ? mask : span;
+    for (int rel_seq = 1; rel_seq <= span && block_count < MAX_SACK_BLOCKS; rel_seq++) {
+        uint32_t seq_num = next_expected + rel_seq;
+        int held = bufs->recv_active[seq_num & mask] && bufs->recv_seqs[seq_num & mask] == seq_num;
+        if (!held) {
+            continue;
+        }
+        
+        // Extend the range over consecutive held messages
+        uint32_t range_end = seq_num + 1;
+        while (rel_seq < span && bufs->recv_active[range_end & mask] && 
+               bufs->recv_seqs[range_end & mask] == range_end) {
+            range_end++;
+            rel_seq++;
+        }
+        block.start = htonl(seq_num);
+        block.end = htonl(range_end);
+        memcpy(ack_packet + HEADER_SIZE + block_count * sizeof(SACK_BLOCK), &block, sizeof(block));
+        block_count++;
     }
-    return seq;
+    
+    encode_header(ack_packet, ACK_MSG, next_expected - 1, block_count * sizeof(SACK_BLOCK),
+                  socket_state(sock_index)->rwnd.size);
+    
+    // This ACK covers every packet received so far, including any held back
+    socket_state(sock_index)->ack.unacked = 0;
+    socket_state(sock_index)->ack.due = 0;
+    socket_state(sock_index)->ack.acks_sent++;
+    stats_write_begin(sock_index);
+    SOCKET_STATS(sock_index)->acks_sent++;
+    stats_write_end(sock_index);
+    TRACE("R: ACK seq=%u rwnd=%d sack_blocks=%d for socket %d\n", next_expected - 1,
+          socket_state(sock_index)->rwnd.size, block_count, sock_index);
+    return HEADER_SIZE + block_count * sizeof(SACK_BLOCK);
 }
 
-// Helper function to extract data length from binary format
-static int extract_data_length(const char *buffer) {
-    int len = 0;
-    for (int i = 9; i <= 18; i++) {
-        len = (len << 1) | (buffer[i] - '0');
-    }
-    return len;
+// Fill in the header of one datagram for send_messages() or recvmmsg()
+static void prepare_message(struct mmsghdr *msg, struct iovec *iov, void *data, int len,
+                            struct sockaddr_in *addr, socklen_t addr_len) {
+    iov->iov_base = data;
+    iov->iov_len = len;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_hdr.msg_name = addr;
+    msg->msg_hdr.msg_namelen = addr_len;
+    msg->msg_hdr.msg_iov = iov;
+    msg->msg_hdr.msg_iovlen = 1;
 }
 
-// Helper function to extract window size from binary format
-static int extract_window_size(const char *buffer) {
-    int size = 0;
-    for (int i = 9; i <= 12; i++) {
-        size = (size << 1) | (buffer[i] - '0');
+// Send prepared datagrams with one sendmmsg() per SEND_BATCH of them. msg_len stays 0
+// for a datagram that could not be sent; it is skipped and recovered by its
+// retransmission timer or the next ACK
+static void send_messages(int sock_id, struct mmsghdr *msgs, int count) {
+    int done = 0;
+    while (done < count) {
+        int chunk = (count - done < SEND_BATCH) ? count - done : SEND_BATCH;
+        int sent = sendmmsg(sock_id, msgs + done, chunk, 0);
+        if (sent < 0) {
+            perror("sendmmsg() error");
+            done++;
+        } else {
+            done += sent;
+        }
     }
-    return size;
 }
 
-// Helper function to send an ACK message
-static void send_ack_message(int sock_id, int seq, int window_size, struct sockaddr_in *addr) {
-    char ack[13]; // ACK message is 13 bytes long
+// Process a received data message; returns the length of the ACK built into ack_packet,
+// 0 if the ACK is held back
+static int process_data_message(int sock_index, const KTP_HEADER *header, const char *payload, char *ack_packet) {
+    uint32_t seq_num = header->seq;
+    int data_len = header->length;
+    int mask = socket_state(sock_index)->recv_info.size - 1;
+    struct ack_info *ack = &socket_state(sock_index)->ack;
     
-    // Format the ACK message
-    ack[0] = ACK_MSG;
-    
-    // Add sequence number in binary format
-    encode_sequence(ack + 1, seq);
+    SOCKET_BUFFERS *bufs = socket_buffers(sock_index);
+    if (bufs == NULL) {
+        return 0;
+    }
     
-    // Add window size in binary format
-    encode_window_size(ack + 9, window_size);
+    TRACE("R: Received DATA seq=%u len=%d for socket %d\n", seq_num, data_len, sock_index);
+    ack->data_received++;
+    struct ktp_stats *stats = SOCKET_STATS(sock_index);
+    stats_write_begin(sock_index);
+    stats->packets_received++;
+    stats->bytes_received += data_len;
     
-    // Send the ACK message
-    sendto(sock_id, ack, sizeof(ack), 0, (struct sockaddr*)addr, sizeof(*addr));
-    printf("R: Sent ACK seq=%d rwnd=%d\n", seq, window_size);
-}
-
-// Process a received data message
-static void process_data_message(int sock_index, char *buffer, int msg_len, struct sockaddr_in *addr) {
-    // Extract sequence number and data length
-    int seq_num = extract_sequence(buffer);
-    int data_len = extract_data_length(buffer);
+    // Duplicates, out-of-order packets and packets filling a gap are acknowledged at
+    // once so that the sender learns about losses and recoveries without delay
+    int ack_now = (ack->delay == 0);
     
-    printf("R: Received DATA seq=%d len=%d for socket %d\n", seq_num, data_len, sock_index);
-    
-    // Handle in-order message
-    if (seq_num == shared_mem[sock_index].rwnd.start) {
-        // Get corresponding buffer slot for this sequence number
-        int buffer_idx = shared_mem[sock_index].rwnd.slots[seq_num];
+    // Accept any new message that fits in the receive buffer, in order or not. Its slot
+    // is still active if it holds an unread earlier message or this one is a duplicate
+    int rel_seq = SEQ_DIFF(seq_num, socket_state(sock_index)->rwnd.start);
+    int buffer_idx = seq_num & mask;
+    if (rel_seq >= 0 && rel_seq <= mask && !bufs->recv_active[buffer_idx]) {
+        memcpy(bufs->recv_buffer[buffer_idx], payload, data_len);
+        bufs->recv_active[buffer_idx] = 1;
+        bufs->recv_lengths[buffer_idx] = data_len;
+        bufs->recv_flags[buffer_idx] = header->window & (FRAG_MORE | FRAG_CONT);
+        bufs->recv_seqs[buffer_idx] = seq_num;
+        socket_state(sock_index)->rwnd.size--;
+        if (SEQ_DIFF(seq_num + 1, socket_state(sock_index)->ack.high_seq) > 0) {
+            socket_state(sock_index)->ack.high_seq = seq_num + 1;
+        }
         
-        if (buffer_idx >= 0) {
-            // Copy data to the buffer slot
-            memcpy(shared_mem[sock_index].recv_info.buffer[buffer_idx], buffer + 19, data_len);
-            shared_mem[sock_index].recv_info.active[buffer_idx] = 1;
-            shared_mem[sock_index].recv_info.lengths[buffer_idx] = data_len;
-            shared_mem[sock_index].rwnd.size--;
-            
-            // Slide window forward for consecutive received packets
-            int next_seq = seq_num;
+        // Slide window forward over consecutive received packets
+        if (rel_seq == 0) {
+            uint32_t next_seq = seq_num;
             do {
-                next_seq = (next_seq + 1) % MAX_SEQ_NUM;
-                shared_mem[sock_index].rwnd.start = next_seq;
-            } while (shared_mem[sock_index].rwnd.slots[next_seq] >= 0 && 
-                    shared_mem[sock_index].recv_info.active[shared_mem[sock_index].rwnd.slots[next_seq]] && 
-                    next_seq != seq_num);
-        }
-    } 
-    // Handle out-of-order message within receive window
-    else {
-        int rel_seq = (seq_num - shared_mem[sock_index].rwnd.start + MAX_SEQ_NUM) % MAX_SEQ_NUM;
-        
-        if (rel_seq < BUFFER_SIZE) {
-            int buffer_idx = shared_mem[sock_index].rwnd.slots[seq_num];
-            
-            if (buffer_idx >= 0 && !shared_mem[sock_index].recv_info.active[buffer_idx]) {
-                // Store out-of-order packet
-                memcpy(shared_mem[sock_index].recv_info.buffer[buffer_idx], buffer + 19, data_len);
-                shared_mem[sock_index].recv_info.active[buffer_idx] = 1;
-                shared_mem[sock_index].recv_info.lengths[buffer_idx] = data_len;
-                shared_mem[sock_index].rwnd.size--;
-            }
+                next_seq++;
+                socket_state(sock_index)->rwnd.start = next_seq;
+            } while (bufs->recv_active[next_seq & mask] && bufs->recv_seqs[next_seq & mask] == next_seq);
+            ack_now |= (next_seq != seq_num + 1);
+        } else {
+            ack_now = 1;
         }
+    } else {
+        stats->duplicates++;
+        ack_now = 1;
     }
+    stats_write_end(sock_index);
     
-    // Check if buffer is now full
-    if (shared_mem[sock_index].rwnd.size == 0) {
-        shared_mem[sock_index].buffer_full = 1;
-        printf("R: Buffer is now full for socket %d\n", sock_index);
+    // Check if buffer is now full; the sender must learn about the zero window at once
+    if (socket_state(sock_index)->rwnd.size == 0) {
+        socket_state(sock_index)->buffer_full = 1;
+        ack_now = 1;
+        TRACE("R: Buffer is now full for socket %d\n", sock_index);
     }
     
-    // Send ACK for the highest consecutive received packet
-    int last_ack = (shared_mem[sock_index].rwnd.start - 1 + MAX_SEQ_NUM) % MAX_SEQ_NUM;
-    send_ack_message(shared_mem[sock_index].sock_info.udp_sockid, last_ack, shared_mem[sock_index].rwnd.size, addr);
+    // Hold back the ACK of in-order data until ACK_EVERY packets or the delay is up;
+    // S() sends it when ack.due passes
+    if (!ack_now && ++ack->unacked < ACK_EVERY) {
+        if (ack->due == 0) {
+            ack->due = monotonic_ns() + ack->delay;
+        }
+        return 0;
+    }
+    
+    // The ACK is sent once the lock is dropped
+    return build_ack_message(sock_index, bufs, ack_packet);
 }
 
-// Process a received ACK message
-static void process_ack_message(int sock_index, char *buffer) {
-    // Extract ACK sequence number and remote window size
-    int ack_seq = extract_sequence(buffer);
-    int remote_window = extract_window_size(buffer);
+// Feed one round-trip sample into the socket's estimator and recompute its RTO (RFC 6298)
+static void update_rtt(int sock_index, int64_t sample) {
+    struct rtt_info *rtt = &socket_state(sock_index)->rtt;
+    
+    if (rtt->srtt == 0) {
+        // First measurement
+        rtt->srtt = sample;
+        rtt->rttvar = sample / 2;
+    } else {
+        int64_t error = rtt->srtt - sample;
+        rtt->rttvar += ((error < 0 ? -error : error) - rtt->rttvar) / 4;
+        rtt->srtt += (sample - rtt->srtt) / 8;
+    }
     
-    printf("R: Received ACK seq=%d rwnd=%d for socket %d\n", ack_seq, remote_window, sock_index);
+    // A fresh sample also ends any exponential backoff
+    int64_t old_rto = rtt->rto;
+    rtt->rto = rtt->srtt + 4 * rtt->rttvar;
+    rtt->rto = (rtt->rto < MIN_RTO_NS) ? MIN_RTO_NS : rtt->rto;
+    rtt->rto = (rtt->rto > MAX_RTO_NS) ? MAX_RTO_NS : rtt->rto;
+    
+    // Every running timer now expires that much earlier
+    if (rtt->rto < old_rto && rtt->timer_due != INT64_MAX) {
+        rtt->timer_due -= old_rto - rtt->rto;
+    }
+}
+
+// Process a received ACK message, returning 1 if S() should be woken up
+static int process_ack_message(int sock_index, const KTP_HEADER *header, const char *payload) {
+    uint32_t ack_seq = header->seq;
+    int remote_window = header->window;
+    
+    SOCKET_BUFFERS *bufs = socket_buffers(sock_index);
+    if (bufs == NULL) {
+        return 0;
+    }
+    
+    TRACE("R: Received ACK seq=%u rwnd=%d for socket %d\n", ack_seq, remote_window, sock_index);
+    struct ktp_stats *stats = SOCKET_STATS(sock_index);
+    int window_was_open = socket_state(sock_index)->swnd.size > 0;
     
     // Check if this ACK acknowledges messages in our window
-    int start_seq = shared_mem[sock_index].swnd.start;
-    int distance = (ack_seq - start_seq + MAX_SEQ_NUM) % MAX_SEQ_NUM;
+    uint32_t start_seq = socket_state(sock_index)->swnd.start;
+    int distance = SEQ_DIFF(ack_seq, start_seq);
+    int queued = SEQ_DIFF(socket_state(sock_index)->send_info.next_seq, start_seq);
+    int mask = socket_state(sock_index)->send_info.size - 1;
 
-    // Only process if this ACK is for a packet we sent (within our current window)
-    if (distance < shared_mem[sock_index].swnd.size) {
+    // Only process if this ACK is for a message still in the send buffer; the window
+    // can have shrunk to zero since it was sent, so do not compare against swnd.size
+    // Send time of the newest message this ACK covers for the first time. Karn's rule:
+    // only a message sent exactly once gives an unambiguous round-trip sample
+    int64_t newest_sent = -1;
+    int newly_acked = 0, newly_sacked = 0;
+    
+    if (distance >= 0 && distance < queued) {
         // Slide window to acknowledge all packets up to this ACK
-        int current_seq = start_seq;
-        
-        while (current_seq != (ack_seq + 1) % MAX_SEQ_NUM) {
-            if (shared_mem[sock_index].swnd.slots[current_seq] >= 0) {
-                // Free buffer slot
-                shared_mem[sock_index].send_info.free_slots++;
-                shared_mem[sock_index].swnd.slots[current_seq] = -1;
-                printf("S: Freeing buffer slot for seq=%d, free_slots now=%d\n", 
-                       current_seq, shared_mem[sock_index].send_info.free_slots);
+        for (uint32_t current_seq = start_seq; current_seq != ack_seq + 1; current_seq++) {
+            int slot_idx = current_seq & mask;
+            if (bufs->send_retries[slot_idx] == 0 && !bufs->send_sacked[slot_idx] &&
+                bufs->send_timestamps[slot_idx] > newest_sent) {
+                newest_sent = bufs->send_timestamps[slot_idx];
             }
             
-            // Clear send timestamp
-            shared_mem[sock_index].send_info.timestamps[current_seq] = -1;
-            
-            // Move to next sequence number
-            current_seq = (current_seq + 1) % MAX_SEQ_NUM;
+            // Free buffer slot and clear send timestamp
+            bufs->send_timestamps[current_seq & mask] = -1;
+            bufs->send_sacked[current_seq & mask] = 0;
+            socket_state(sock_index)->send_info.free_slots++;
         }
+        TRACE("S: Freed %d buffer slots up to seq=%u, free_slots now=%d\n",
+              distance + 1, ack_seq, socket_state(sock_index)->send_info.free_slots);
         
         // Update window start
-        shared_mem[sock_index].swnd.start = (ack_seq + 1) % MAX_SEQ_NUM;
+        socket_state(sock_index)->swnd.start = ack_seq + 1;
+        start_seq = ack_seq + 1;
+        queued -= distance + 1;
+        newly_acked = distance + 1;
+    }
+    
+    // Mark selectively acknowledged messages so that timeouts never resend them
+    for (int block_idx = 0; block_idx < (int)(header->length / sizeof(SACK_BLOCK)); block_idx++) {
+        SACK_BLOCK block;
+        memcpy(&block, payload + block_idx * sizeof(SACK_BLOCK), sizeof(block));
+        int first = SEQ_DIFF(ntohl(block.start), start_seq);
+        int last = SEQ_DIFF(ntohl(block.end), start_seq);
+        
+        // Clip the range to messages that are still queued
+        first = (first < 0) ? 0 : first;
+        last = (last > queued) ? queued : last;
+        for (int rel_seq = first; rel_seq < last; rel_seq++) {
+            int slot_idx = (start_seq + rel_seq) & mask;
+            if (!bufs->send_sacked[slot_idx] && bufs->send_retries[slot_idx] == 0 &&
+                bufs->send_timestamps[slot_idx] > newest_sent) {
+                newest_sent = bufs->send_timestamps[slot_idx];
+            }
+            newly_sacked += !bufs->send_sacked[slot_idx];
+            bufs->send_sacked[slot_idx] = 1;
+        }
+        if (last > first && SEQ_DIFF(start_seq + last, socket_state(sock_index)->loss.sacked_high) > 0) {
+            socket_state(sock_index)->loss.sacked_high = start_seq + last;
+        }
+    }
+    
+    if (newest_sent != -1) {
+        update_rtt(sock_index, monotonic_ns() - newest_sent);
+    }
+    
+    // Grow the congestion window, or count a duplicate ACK
+    struct cong_info *cc = &socket_state(sock_index)->cc;
+    struct loss_info *loss = &socket_state(sock_index)->loss;
+    int was_recovering = cc->in_recovery;
+    cc_on_ack(cc, start_seq, newly_acked, newly_sacked, socket_state(sock_index)->rtt.srtt);
+    
+    // A tail-loss probe that is SACKed while earlier messages are not shows that they
+    // were lost; recover them like after duplicate ACKs
+    if (loss->tlp_sent && (newly_acked > 0 || newly_sacked > 0)) {
+        uint32_t probe_seq = loss->tlp_high - 1;
+        loss->tlp_sent = 0;
+        if (SEQ_DIFF(probe_seq, start_seq) > 0 && bufs->send_sacked[probe_seq & mask]) {
+            TRACE("R: Tail-loss probe seq=%u revealed a loss on socket %d\n", probe_seq, sock_index);
+            cc_on_loss(cc, start_seq);
+        }
+    }
+    
+    // In fast recovery, have S() resend whatever this ACK shows to be missing
+    if (cc->in_recovery && !was_recovering) {
+        loss->recovery_start = monotonic_ns();
+    }
+    if (cc->in_recovery && (newly_acked > 0 || newly_sacked > 0)) {
+        loss->rexmit_pending = 1;
     }
     
     // Always update send window size based on receiver's capacity
-    shared_mem[sock_index].swnd.size = remote_window;
-    printf("S: Updated window for socket %d: start=%d size=%d\n", 
-           sock_index, shared_mem[sock_index].swnd.start, shared_mem[sock_index].swnd.size);
+    socket_state(sock_index)->swnd.size = remote_window;
+    stats_write_begin(sock_index);
+    stats->acks_received++;
+    stats->dupacks += (newly_acked == 0 && newly_sacked > 0);
+    stats->zero_windows += (remote_window == 0 && window_was_open && queued > 0);
+    stats->srtt = socket_state(sock_index)->rtt.srtt;
+    stats->rto = socket_state(sock_index)->rtt.rto;
+    stats->cwnd = cc->cwnd;
+    stats_write_end(sock_index);
+    TRACE("S: Updated window for socket %d: start=%u size=%d cwnd=%d ssthresh=%d srtt=%lldus rto=%lldus\n", 
+          sock_index, socket_state(sock_index)->swnd.start, socket_state(sock_index)->swnd.size,
+          cc->cwnd, cc->ssthresh, (long long)(socket_state(sock_index)->rtt.srtt / 1000),
+          (long long)(socket_state(sock_index)->rtt.rto / 1000));
+    
+    // The window may now cover messages that k_sendto queued earlier, or a partial
+    // stream segment may no longer have to wait
+    if (socket_state(sock_index)->send_info.free_slots < socket_state(sock_index)->send_info.size ||
+        socket_state(sock_index)->send_info.fill > 0) {
+        return mark_tx_pending(sock_index);
+    }
+    return 0;
+}
+
+// Number of messages from swnd.start that may be in flight: limited by the peer's window,
+// the congestion window and by what k_sendto has queued (caller holds the socket lock)
+static int send_limit(int sock_index) {
+    int queued = SEQ_DIFF(socket_state(sock_index)->send_info.next_seq, socket_state(sock_index)->swnd.start);
+    int window = cc_window(&socket_state(sock_index)->cc);
+    window = (socket_state(sock_index)->swnd.size < window) ? socket_state(sock_index)->swnd.size : window;
+    return (window < queued) ? window : queued;
 }
 
-// Retransmit packets in case of timeout
-static void retransmit_packets(int sock_index) {
+// Fill in the DATA header of a sequence number's send slot and stage the slot itself.
+// No copy is made: the slot stays in use until the message is acknowledged, and a
+// later k_sendto cannot reuse it before that
+static void stage_packet(int sock_index, SOCKET_BUFFERS *bufs, uint32_t seq_num, struct tx_batch *batch) {
+    int slot_idx = seq_num & (socket_state(sock_index)->send_info.size - 1);
+    int data_len = bufs->send_lengths[slot_idx];
+    char *packet_buffer = bufs->send_buffer[slot_idx];
+    
+    // Add the DATA header in front of the message, with its fragment flags
+    encode_header(packet_buffer, DATA_MSG, seq_num, data_len, bufs->send_flags[slot_idx]);
+    
+    // A slot that has a send time was sent before
+    struct ktp_stats *stats = SOCKET_STATS(sock_index);
+    stats_write_begin(sock_index);
+    stats->packets_sent++;
+    stats->bytes_sent += data_len;
+    stats->retransmits += (bufs->send_timestamps[slot_idx] != -1);
+    stats_write_end(sock_index);
+    
+    // The timer starts now; the packet leaves as soon as the lock is released
+    int64_t now = monotonic_ns();
+    bufs->send_timestamps[slot_idx] = now;
+    cc_on_sent(&socket_state(sock_index)->cc, seq_num);
+    if (now + socket_state(sock_index)->rtt.rto < batch->next_deadline) {
+        batch->next_deadline = now + socket_state(sock_index)->rtt.rto;
+    }
+    if (now + socket_state(sock_index)->rtt.rto < socket_state(sock_index)->rtt.timer_due) {
+        socket_state(sock_index)->rtt.timer_due = now + socket_state(sock_index)->rtt.rto;
+    }
+    batch->seqs[batch->count] = seq_num;
+    batch->lengths[batch->count] = HEADER_SIZE + data_len;
+    batch->packets[batch->count] = packet_buffer;
+    batch->count++;
+}
+
+// Record the destination of a socket in a batch (caller holds the socket lock)
+static void prepare_tx_batch(int sock_index, struct tx_batch *batch) {
+    batch->sock_id = socket_state(sock_index)->sock_info.udp_sockid;
+    batch->sock_index = sock_index;
+    batch->count = 0;
+    batch->ack_len = 0;
+    batch->next_deadline = INT64_MAX;
+    
     // Setup destination address
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(shared_mem[sock_index].sock_info.port);
-    inet_pton(AF_INET, shared_mem[sock_index].sock_info.ip_addr, &(dest_addr.sin_addr));
+    memset(&batch->dest_addr, 0, sizeof(batch->dest_addr));
+    batch->dest_addr.sin_family = AF_INET;
+    batch->dest_addr.sin_port = htons(socket_state(sock_index)->sock_info.port);
+    inet_pton(AF_INET, socket_state(sock_index)->sock_info.ip_addr, &(batch->dest_addr.sin_addr));
+}
+
+// Stage every packet whose own retransmission timer has expired, skipping those the
+// receiver has selectively acknowledged; returns the number of packets staged
+static int retransmit_packets(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    uint32_t start_seq = socket_state(sock_index)->swnd.start;
+    int mask = socket_state(sock_index)->send_info.size - 1;
+    int64_t current_time = monotonic_ns();
+    int64_t rto = socket_state(sock_index)->rtt.rto;
+    struct rtt_info *rtt = &socket_state(sock_index)->rtt;
+    struct loss_info *loss = &socket_state(sock_index)->loss;
+    int staged = 0;
     
-    // Start from window base
-    int seq_num = shared_mem[sock_index].swnd.start;
+    // The passes every ACK triggers only look at the timers once one can have expired,
+    // or while messages lost in the last timeout are still to be resent
+    int resending = SEQ_DIFF(loss->timeout_high, start_seq) > 0;
+    if (current_time < rtt->timer_due && !resending) {
+        if (rtt->timer_due < batch->next_deadline) {
+            batch->next_deadline = rtt->timer_due;
+        }
+        return 0;
+    }
+    rtt->timer_due = INT64_MAX;  // Lowered again below and by stage_packet()
     
-    printf("S: Retransmitting packets for socket %d starting at seq %d\n", sock_index, seq_num);
+    // A timeout of the oldest message collapses the congestion window before anything
+    // is resent, so that only it goes out until ACKs open the window again. With a
+    // zero window nothing is lost; probe_zero_window() handles the oldest message
+    int64_t oldest_sent = bufs->send_timestamps[start_seq & mask];
+    int oldest_expired = start_seq != socket_state(sock_index)->send_info.next_seq &&
+                         socket_state(sock_index)->swnd.size > 0 && oldest_sent != -1 &&
+                         current_time - (oldest_sent > loss->tlp_at ? oldest_sent : loss->tlp_at) >= rto;
+    if (oldest_expired) {
+        cc_on_timeout(&socket_state(sock_index)->cc, start_seq);
+        
+        // Everything outstanding is lost too (RFC 5681): resend it as ACKs open the window
+        // instead of each message waiting for its own, ever longer, timer
+        loss->timeout_high = socket_state(sock_index)->cc.high_seq;
+        loss->timeout_at = current_time;
+    }
+    int limit = send_limit(sock_index);
     
     // Iterate through the send window
-    while (seq_num != (shared_mem[sock_index].swnd.start + shared_mem[sock_index].swnd.size) % MAX_SEQ_NUM) {
-        if (shared_mem[sock_index].swnd.slots[seq_num] >= 0) {
-            // Get buffer index for this sequence number
-            int buffer_idx = shared_mem[sock_index].swnd.slots[seq_num];
-            int data_len = shared_mem[sock_index].send_info.lengths[buffer_idx];
-            
-            // Prepare message with header
-            char *packet_buffer = malloc(19 + data_len);
-            if (!packet_buffer) {
-                perror("Memory allocation failed");
-                return;
-            }
-            
-            // Set message type (DATA)
-            packet_buffer[0] = DATA_MSG;
-            
-            // Add sequence number
-            encode_sequence(packet_buffer + 1, seq_num);
-            
-            // Add data length
-            for (int bit_idx = 0; bit_idx < 10; bit_idx++) {
-                packet_buffer[18 - bit_idx] = ((data_len >> bit_idx) & 1) + '0';
-            }
-            
-            // Copy data from send buffer
-            memcpy(packet_buffer + 19, shared_mem[sock_index].send_info.buffer[buffer_idx], data_len);
-            
-            // Send the packet
-            if (sendto(shared_mem[sock_index].sock_info.udp_sockid, packet_buffer, 19 + data_len, 0,
-                     (struct sockaddr*)&dest_addr, sizeof(dest_addr)) < 0) {
-                perror("Failed to retransmit packet");
-            } else {
-                // Update timestamp
-                shared_mem[sock_index].send_info.timestamps[seq_num] = time(NULL);
-                printf("S: Retransmitted packet seq=%d for socket %d\n", seq_num, sock_index);
-            }
-            
-            free(packet_buffer);
+    for (int win_idx = 0; win_idx < limit; win_idx++) {
+        uint32_t seq_num = start_seq + win_idx;
+        int64_t sent_at = bufs->send_timestamps[seq_num & mask];
+        if (sent_at == -1 || bufs->send_sacked[seq_num & mask]) {
+            continue;
         }
         
-        // Move to next sequence number
-        seq_num = (seq_num + 1) % MAX_SEQ_NUM;
+        // A tail-loss probe restarts the timers of the messages sent before it
+        int64_t timer_start = (sent_at > loss->tlp_at) ? sent_at : loss->tlp_at;
+        int timed_out = SEQ_DIFF(loss->timeout_high, seq_num) > 0 && sent_at < loss->timeout_at;
+        if (timed_out || current_time - timer_start >= rto) {
+            TRACE("S: Timeout for seq %u on socket %d, retransmitting\n", seq_num, sock_index);
+            bufs->send_retries[seq_num & mask]++;
+            stage_packet(sock_index, bufs, seq_num, batch);
+            staged++;
+            if (win_idx > 0 && !timed_out) {
+                // A later message was lost while the oldest is still on its way
+                cc_on_loss(&socket_state(sock_index)->cc, start_seq);
+            }
+        } else if (timer_start + rto < batch->next_deadline) {
+            // Still running; S() must wake up when it expires
+            batch->next_deadline = timer_start + rto;
+        }
+        if (timer_start + rto > current_time && timer_start + rto < rtt->timer_due) {
+            rtt->timer_due = timer_start + rto;
+        }
+    }
+    
+    // Messages sent beyond the windows' limit are not looked at here; keep scanning
+    // on every pass until the windows cover them again
+    if (SEQ_DIFF(socket_state(sock_index)->cc.high_seq, start_seq) > limit) {
+        rtt->timer_due = 0;
     }
+    
+    // Exponential backoff, as for a single retransmission timer on the oldest message,
+    // until an ACK for a fresh message gives a new sample
+    if (oldest_expired) {
+        int64_t backed_off = socket_state(sock_index)->rtt.rto * 2;
+        socket_state(sock_index)->rtt.rto = (backed_off > MAX_RTO_NS) ? MAX_RTO_NS : backed_off;
+        stats_write_begin(sock_index);
+        SOCKET_STATS(sock_index)->rto = socket_state(sock_index)->rtt.rto;
+        SOCKET_STATS(sock_index)->cwnd = socket_state(sock_index)->cc.cwnd;
+        stats_write_end(sock_index);
+        TRACE("S: RTO for socket %d backed off to %lld us\n", sock_index,
+              (long long)(socket_state(sock_index)->rtt.rto / 1000));
+    }
+    return staged;
 }
 
-// Send new packets that haven't been transmitted yet
-static void transmit_new_packets(int sock_index) {
-    // Setup destination address
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(shared_mem[sock_index].sock_info.port);
-    inet_pton(AF_INET, shared_mem[sock_index].sock_info.ip_addr, &(dest_addr.sin_addr));
-    
-    // Iterate through the sending window
-    int seq_num = shared_mem[sock_index].swnd.start;
-    while (seq_num != (shared_mem[sock_index].swnd.start + shared_mem[sock_index].swnd.size) % MAX_SEQ_NUM) {
+// Stage new packets that haven't been transmitted yet
+static void transmit_new_packets(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    uint32_t start_seq = socket_state(sock_index)->swnd.start;
+    int limit = send_limit(sock_index);
+    int mask = socket_state(sock_index)->send_info.size - 1;
+    
+    // Everything before cc.high_seq has been sent at least once
+    int first = SEQ_DIFF(socket_state(sock_index)->cc.high_seq, start_seq);
+    first = (first < 0) ? 0 : first;
+    for (int win_idx = first; win_idx < limit; win_idx++) {
         // Check if this sequence number has data but hasn't been sent yet
-        if (shared_mem[sock_index].swnd.slots[seq_num] >= 0 && shared_mem[sock_index].send_info.timestamps[seq_num] == -1) {
-            // Get buffer index for this sequence number
-            int buffer_idx = shared_mem[sock_index].swnd.slots[seq_num];
-            int data_len = shared_mem[sock_index].send_info.lengths[buffer_idx];
-            
-            // Prepare message with header
-            char *packet_buffer = malloc(19 + data_len);
-            if (!packet_buffer) {
-                perror("Memory allocation failed");
-                return;
-            }
-            
-            // Set message type (DATA)
-            packet_buffer[0] = DATA_MSG;
-            
-            // Add sequence number
-            encode_sequence(packet_buffer + 1, seq_num);
-            
-            // Add data length
-            for (int bit_idx = 0; bit_idx < 10; bit_idx++) {
-                packet_buffer[18 - bit_idx] = ((data_len >> bit_idx) & 1) + '0';
-            }
-            
-            // Copy data from send buffer
-            memcpy(packet_buffer + 19, shared_mem[sock_index].send_info.buffer[buffer_idx], data_len);
-            
-            // Send the packet
-            if (sendto(shared_mem[sock_index].sock_info.udp_sockid, packet_buffer, 19 + data_len, 0,
-                     (struct sockaddr*)&dest_addr, sizeof(dest_addr)) < 0) {
-                perror("Failed to send new packet");
-            } else {
-                // Update timestamp
-                shared_mem[sock_index].send_info.timestamps[seq_num] = time(NULL);
-                printf("S: Sent new packet seq=%d for socket %d\n", seq_num, sock_index);
-            }
-            
-            free(packet_buffer);
+        uint32_t seq_num = start_seq + win_idx;
+        if (bufs->send_timestamps[seq_num & mask] == -1) {
+            stage_packet(sock_index, bufs, seq_num, batch);
         }
+    }
+}
+
+// Stage every message that fast recovery considers lost: not SACKed, although a later
+// message was, and not resent since the recovery began. Duplicate ACKs, a partial ACK
+// or a tail-loss probe find them well before their retransmission timers expire
+static void fast_retransmit(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    struct loss_info *loss = &socket_state(sock_index)->loss;
+    if (!loss->rexmit_pending) {
+        return;
+    }
+    loss->rexmit_pending = 0;
+    
+    // Only messages below the highest SACKed one can be known to be missing
+    uint32_t start_seq = socket_state(sock_index)->swnd.start;
+    int mask = socket_state(sock_index)->send_info.size - 1;
+    int outstanding = SEQ_DIFF(socket_state(sock_index)->cc.high_seq, start_seq);
+    int sacked_span = SEQ_DIFF(loss->sacked_high, start_seq);
+    
+    // Without SACKs, as after a partial ACK, only the oldest message is known to be missing
+    sacked_span = (sacked_span <= 0 && outstanding > 0) ? 1 : sacked_span;
+    for (int rel_seq = 0; rel_seq < sacked_span; rel_seq++) {
+        uint32_t seq_num = start_seq + rel_seq;
+        int64_t sent_at = bufs->send_timestamps[seq_num & mask];
+        if (bufs->send_sacked[seq_num & mask] || sent_at == -1 || sent_at >= loss->recovery_start) {
+            continue;
+        }
+        TRACE("S: Fast retransmit of seq %u on socket %d\n", seq_num, sock_index);
+        bufs->send_retries[seq_num & mask]++;
+        loss->fast_retransmits++;
+        stage_packet(sock_index, bufs, seq_num, batch);
+    }
+}
+
+// Resend the newest unacknowledged message once nothing has been acknowledged for
+// TLP_SRTT_FACTOR round trips after it was sent (RFC 8985). Its ACK, or a SACK of it,
+// shows whether the messages before it were lost, long before the RTO would
+static void tail_loss_probe(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    struct loss_info *loss = &socket_state(sock_index)->loss;
+    struct cong_info *cc = &socket_state(sock_index)->cc;
+    uint32_t start_seq = socket_state(sock_index)->swnd.start;
+    int64_t srtt = socket_state(sock_index)->rtt.srtt;
+    
+    // Needs a tail of sent messages and no other recovery in progress; queued messages
+    // the windows hold back would be sent by their ACKs instead
+    if (cc->in_recovery || loss->tlp_high == cc->high_seq ||
+        start_seq == cc->high_seq || cc->high_seq != socket_state(sock_index)->send_info.next_seq ||
+        socket_state(sock_index)->swnd.size == 0) {
+        return;
+    }
+    
+    // Leave room for a delayed ACK when only one message is out
+    int mask = socket_state(sock_index)->send_info.size - 1;
+    uint32_t last_seq = cc->high_seq - 1;
+    int64_t pto = TLP_SRTT_FACTOR * srtt + (last_seq == start_seq ? ACK_DELAY_NS : 0);
+    int64_t due = bufs->send_timestamps[last_seq & mask] + pto;
+    if (srtt == 0) {
+        // No RTT sample yet: probe in place of the first timeout of the oldest message,
+        // which then waits another RTO instead of collapsing the window at once
+        due = bufs->send_timestamps[start_seq & mask] + socket_state(sock_index)->rtt.rto;
+    } else if (pto >= socket_state(sock_index)->rtt.rto) {
+        return;  // The retransmission timer fires first anyway
+    }
+    
+    if (monotonic_ns() < due) {
+        if (due < batch->next_deadline) {
+            batch->next_deadline = due;
+        }
+        return;
+    }
+    
+    // Probe with the newest message the receiver has not SACKed
+    while (last_seq != start_seq && bufs->send_sacked[last_seq & mask]) {
+        last_seq--;
+    }
+    TRACE("S: Tail-loss probe seq %u on socket %d\n", last_seq, sock_index);
+    bufs->send_retries[last_seq & mask]++;
+    loss->tail_probes++;
+    loss->tlp_sent = 1;
+    loss->tlp_high = cc->high_seq;
+    loss->tlp_at = monotonic_ns();
+    stage_packet(sock_index, bufs, last_seq, batch);
+}
+
+// Stage the first queued packet as a probe, once per RTO, while the peer advertises a
+// zero window, so that a lost window update cannot stall the socket forever
+static void probe_zero_window(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    uint32_t seq_num = socket_state(sock_index)->swnd.start;
+    if (socket_state(sock_index)->swnd.size != 0 || seq_num == socket_state(sock_index)->send_info.next_seq) {
+        return;
+    }
+    
+    int slot_idx = seq_num & (socket_state(sock_index)->send_info.size - 1);
+    int64_t sent_at = bufs->send_timestamps[slot_idx];
+    int64_t rto = socket_state(sock_index)->rtt.rto;
+    if (sent_at == -1 || monotonic_ns() - sent_at >= rto) {
+        TRACE("S: Probing zero window for socket %d with seq %u\n", sock_index, seq_num);
+        bufs->send_retries[slot_idx] += (sent_at != -1);
+        stage_packet(sock_index, bufs, seq_num, batch);
+    } else if (sent_at + rto < batch->next_deadline) {
+        batch->next_deadline = sent_at + rto;
+    }
+}
+
+// Queue a partial stream segment once Nagle's rule lets it go: nothing sent is still
+// unacknowledged, no-delay was set, or it has been held back for STREAM_FLUSH_DELAY_NS
+static void flush_stream_tail(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    struct send_info *send = &socket_state(sock_index)->send_info;
+    if (send->fill == 0) {
+        return;
+    }
+    
+    int64_t due = send->fill_start + STREAM_FLUSH_DELAY_NS;
+    if (send->nodelay || socket_state(sock_index)->swnd.start == send->next_seq || monotonic_ns() >= due) {
+        flush_stream_segment(sock_index, bufs);
+        socket_state(sock_index)->tx_pending = 0;  // Sent in this pass
+    } else if (due < batch->next_deadline) {
+        batch->next_deadline = due;
+    }
+}
+
+// Stage a window update once k_recvfrom has reopened a receive buffer that was full
+static void stage_window_update(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    if (socket_state(sock_index)->buffer_full == 1 && socket_state(sock_index)->rwnd.size > 0) {
+        socket_state(sock_index)->buffer_full = 0;
+        TRACE("S: Sending window update for socket %d\n", sock_index);
         
-        // Move to next sequence number
-        seq_num = (seq_num + 1) % MAX_SEQ_NUM;
+        // Last acknowledged sequence number with the reopened window
+        batch->ack_len = build_ack_message(sock_index, bufs, batch->ack_packet);
     }
 }
 
-// Receiver thread function (R)
-void *R() {
-    printf("Starting receiver thread\n");
-    fd_set read_fds;
-    int max_fd = 0;
+// Stage the ACK that process_data_message() held back once its delay is up
+static void stage_delayed_ack(int sock_index, SOCKET_BUFFERS *bufs, struct tx_batch *batch) {
+    int64_t due = socket_state(sock_index)->ack.due;
+    if (due == 0 || batch->ack_len > 0) {
+        return;  // Nothing held back, or a window update already acknowledges it
+    }
     
-    FD_ZERO(&read_fds);
+    if (monotonic_ns() >= due) {
+        batch->ack_len = build_ack_message(sock_index, bufs, batch->ack_packet);
+    } else if (due < batch->next_deadline) {
+        batch->next_deadline = due;
+    }
+}
+
+// Send the window update and every staged packet of a batch (called without any lock held)
+static void flush_tx_batch(struct tx_batch *batch) {
+    // k_close has already had the UDP socket closed; nothing can be delivered any more
+    if (batch->sock_id < 0) {
+        batch->count = 0;
+        return;
+    }
+    int msg_count = 0;
+    if (batch->ack_len > 0) {
+        prepare_message(&batch->msgs[msg_count], &batch->iovs[msg_count], batch->ack_packet,
+                        batch->ack_len, &batch->dest_addr, sizeof(batch->dest_addr));
+        msg_count++;
+    }
+    for (int pkt_idx = 0; pkt_idx < batch->count; pkt_idx++) {
+        prepare_message(&batch->msgs[msg_count], &batch->iovs[msg_count], batch->packets[pkt_idx],
+                        batch->lengths[pkt_idx], &batch->dest_addr, sizeof(batch->dest_addr));
+        msg_count++;
+    }
+    send_messages(batch->sock_id, batch->msgs, msg_count);
     
-    while(1) {
-        // Prepare file descriptor set for select
-        fd_set temp_fds = read_fds;
-        struct timeval timeout;
-        timeout.tv_sec = T / 2;  // Use half the timeout period for responsiveness
-        timeout.tv_usec = 0;
+    // A packet that was not sent is recovered by its retransmission timer
+    for (int pkt_idx = 0; pkt_idx < batch->count; pkt_idx++) {
+        if (batch->msgs[msg_count - batch->count + pkt_idx].msg_len > 0) {
+            TRACE("S: Sent packet seq=%u for socket %d\n", batch->seqs[pkt_idx], batch->sock_index);
+        }
+    }
+    batch->count = 0;
+}
+
+/* Process the messages of the current batch listed in msg_idxs, all for one KTP socket,
+ * and send their ACKs from udp_sockid. Callers blocked in k_recvfrom on new in-order
+ * data, or in k_sendto and k_close on freed buffer space, are woken. Returns 1 if
+ * in-order data became readable (caller holds the socket lock, which is released here) */
+static int process_messages(struct worker *self, int sock_index, int udp_sockid, const int *msg_idxs, int count) {
+    int ack_count = 0, ring = 0;
+    uint32_t readable_end = socket_state(sock_index)->rwnd.start;
+    int64_t ack_due = socket_state(sock_index)->ack.due;
+    int free_slots = socket_state(sock_index)->send_info.free_slots;
+    for (int batch_idx = 0; batch_idx < count; batch_idx++) {
+        int msg_idx = msg_idxs[batch_idx];
         
-        // Wait for incoming messages or timeout
-        int select_result = select(max_fd + 1, &temp_fds, NULL, NULL, &timeout);
+        KTP_HEADER header;
+        const char *message = self->message_buffers[msg_idx];
+        if (decode_header(message, self->msgs[msg_idx].msg_len, &header) < 0) {
+            continue;
+        }
         
-        if (select_result < 0) {
-            if (errno != EINTR) {
-                perror("select() error");
+        // Process based on message type
+        if (header.type == DATA_MSG) {
+            int ack_len = process_data_message(sock_index, &header, message + HEADER_SIZE,
+                                               self->ack_packets[ack_count]);
+            if (ack_len > 0) {
+                prepare_message(&self->acks[ack_count], &self->ack_iovs[ack_count],
+                                self->ack_packets[ack_count], ack_len, &self->src_addrs[msg_idx],
+                                self->msgs[msg_idx].msg_hdr.msg_namelen);
+                ack_count++;
+            }
+        } else if (header.type == ACK_MSG) {
+            ring |= process_ack_message(sock_index, &header, message + HEADER_SIZE);
+        } else {
+            TRACE("R: Received unknown message type: %d\n", header.type);
+        }
+    }
+    
+    // Have S() send an ACK held back in this batch when its delay is up
+    if (ack_due == 0 && socket_state(sock_index)->ack.due != 0) {
+        ring |= mark_tx_pending(sock_index);
+    }
+    
+    // A peer's entry may only be looked up under the lock
+    int readable = 0, wake_recv = 0, wake_send = 0;
+    uint32_t *recv_event = &socket_state(sock_index)->recv_event;
+    uint32_t *send_event = &socket_state(sock_index)->send_event;
+    if (socket_state(sock_index)->rwnd.start != readable_end) {
+        socket_state(sock_index)->recv_event++;
+        wake_recv = socket_state(sock_index)->recv_waiters > 0;
+        readable = 1;
+    }
+    if (socket_state(sock_index)->send_info.free_slots > free_slots) {
+        socket_state(sock_index)->send_event++;
+        wake_send = socket_state(sock_index)->send_waiters > 0;
+    }
+    unlock_socket(sock_index);
+    
+    // All ACKs of the batch leave together
+    send_messages(udp_sockid, self->acks, ack_count);
+    if (ring) {
+        ring_doorbell(sock_index);
+    }
+    if (wake_recv) {
+        wake_socket_event(recv_event);
+    }
+    if (wake_send) {
+        wake_socket_event(send_event);
+    }
+    return readable;
+}
+
+// Next number of a socket's impairment random numbers, uniform in [0, 1) (xorshift64*)
+static double impair_random(struct impair_state *state) {
+    state->random ^= state->random >> 12;
+    state->random ^= state->random << 25;
+    state->random ^= state->random >> 27;
+    return (double)((state->random * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53);
+}
+
+// Decide whether the impairment loses the next packet
+static int impair_lose(const struct ktp_impairment *impair, struct impair_state *state) {
+    if (impair->loss_model == LOSS_BERNOULLI) {
+        return impair->loss > 0 && impair_random(state) < impair->loss;
+    }
+    if (impair->loss_model == LOSS_GILBERT) {
+        // Change state first, then lose with the probability of the new state
+        double change = impair_random(state);
+        state->bad = state->bad ? !(change < impair->gilbert_r) : (change < impair->gilbert_p);
+        return impair_random(state) < (state->bad ? impair->gilbert_loss_bad : impair->loss);
+    }
+    return 0;
+}
+
+// CLOCK_MONOTONIC ns at which a copy of a packet of len wire bytes, received at now,
+// comes out of the impairment; now if it is not held back at all
+static int64_t release_time(const struct ktp_impairment *impair, struct impair_state *state, int64_t now, int len) {
+    int64_t release = now;
+    if (impair->rate_kbps > 0) {
+        // Queue behind the packets still going through the link, then take len * 8 bits of it
+        int64_t start = (state->link_free > now) ? state->link_free : now;
+        state->link_free = start + (int64_t)len * 8 * 1000000 / impair->rate_kbps;
+        release = state->link_free;
+    }
+    
+    int64_t delay_us = impair->delay_us;
+    if (impair->jitter_us > 0) {
+        delay_us += (int64_t)(impair_random(state) * (2.0 * impair->jitter_us + 1)) - impair->jitter_us;
+    }
+    if (impair->reorder > 0 && impair_random(state) < impair->reorder) {
+        delay_us += impair->reorder_gap_us;
+    }
+    return (delay_us > 0) ? release + delay_us * 1000 : release;
+}
+
+// 1 if held packet slot a is released before slot b
+static int held_before(const struct worker *self, int a, int b) {
+    const struct held_packet *first = &self->held[a], *second = &self->held[b];
+    return first->release < second->release ||
+           (first->release == second->release && first->order < second->order);
+}
+
+// Copy message msg_idx of the current batch into the held packets; -1 if they are full
+static int hold_packet(struct worker *self, int sock_index, int udp_sockid, int msg_idx, int64_t release) {
+    if (self->free_count == 0) {
+        return -1;
+    }
+    int slot = self->free_held[--self->free_count];
+    struct held_packet *packet = &self->held[slot];
+    packet->release = release;
+    packet->order = self->held_order++;
+    packet->sock_index = sock_index;
+    packet->udp_sockid = udp_sockid;
+    packet->src_addr = self->src_addrs[msg_idx];
+    packet->addr_len = self->msgs[msg_idx].msg_hdr.msg_namelen;
+    packet->len = self->msgs[msg_idx].msg_len;
+    memcpy(packet->data, self->message_buffers[msg_idx], packet->len);
+    
+    // Sift up
+    int pos = self->held_count++;
+    while (pos > 0 && held_before(self, slot, self->held_heap[(pos - 1) / 2])) {
+        self->held_heap[pos] = self->held_heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    self->held_heap[pos] = slot;
+    return 0;
+}
+
+// Take the earliest held packet off the heap and return its slot, which stays
+// intact until the next hold_packet
+static int pop_held(struct worker *self) {
+    int top = self->held_heap[0];
+    int last = self->held_heap[--self->held_count];
+    
+    // Sift the last slot down from the root
+    int pos = 0;
+    while (2 * pos + 1 < self->held_count) {
+        int child = 2 * pos + 1;
+        if (child + 1 < self->held_count && held_before(self, self->held_heap[child + 1], self->held_heap[child])) {
+            child++;
+        }
+        if (!held_before(self, self->held_heap[child], last)) {
+            break;
+        }
+        self->held_heap[pos] = self->held_heap[child];
+        pos = child;
+    }
+    self->held_heap[pos] = last;
+    self->free_held[self->free_count++] = top;
+    return top;
+}
+
+/* Run the batch just received for sock_index through the socket's impairment (caller
+ * holds the socket lock). Copies due now are listed in msg_idxs, a duplicated packet
+ * possibly twice, and their count is returned; later ones are held by the worker
+ * until R() releases them */
+static int impair_messages(struct worker *self, int sock_index, int udp_sockid, int received, int *msg_idxs) {
+    const struct ktp_impairment *impair = &socket_state(sock_index)->impair;
+    struct impair_state *state = &socket_state(sock_index)->impair_state;
+    int64_t now = monotonic_ns();
+    int count = 0, drops = 0;
+    for (int msg_idx = 0; msg_idx < received; msg_idx++) {
+        if (impair_lose(impair, state)) {
+            TRACE("R: Dropped message for socket %d\n", sock_index);
+            drops++;
+            continue;
+        }
+        
+        int copies = (impair->duplicate > 0 && impair_random(state) < impair->duplicate) ? 2 : 1;
+        for (int copy = 0; copy < copies; copy++) {
+            int64_t release = release_time(impair, state, now, self->msgs[msg_idx].msg_len);
+            if (release <= now) {
+                msg_idxs[count++] = msg_idx;
+            } else if (hold_packet(self, sock_index, udp_sockid, msg_idx, release) < 0) {
+                TRACE("R: Impairment queue full, dropped message for socket %d\n", sock_index);
+                drops++;
             }
+        }
+    }
+    
+    if (drops > 0) {
+        stats_write_begin(sock_index);
+        SOCKET_STATS(sock_index)->drops += drops;
+        stats_write_end(sock_index);
+    }
+    return count;
+}
+
+/* Hand the messages of the current batch listed in msg_idxs, received by an unconnected
+ * socket, to the peers that sent them, opening a peer on its first well-formed DATA packet;
+ * other packets of unknown peers are dropped. k_recvfrom waits on the unconnected socket,
+ * so its recv_event is bumped if any peer has new in-order data (caller holds the
+ * socket lock, which the peers share and which is released here) */
+static void receive_from_peers(struct worker *self, int sock_index, int udp_sockid, const int *msg_idxs, int count) {
+    int peers[IMPAIRED_BATCH], opened_msgs[IMPAIRED_BATCH], opened_peers[IMPAIRED_BATCH], opened_count = 0;
+    for (int batch_idx = 0; batch_idx < count; batch_idx++) {
+        int msg_idx = msg_idxs[batch_idx];
+        const char *message = self->message_buffers[msg_idx];
+        struct sockaddr_in *addr = &self->src_addrs[msg_idx];
+        peers[batch_idx] = find_peer(sock_index, addr);
+        if (peers[batch_idx] >= 0) {
             continue;
         }
         
-        // Update socket set and send window updates if needed
-        FD_ZERO(&read_fds);
-        max_fd = 0;
+        // Only a well-formed DATA packet takes a peer entry; process_messages decodes
+        // the header again, but stray or malformed packets must not use up the table
+        KTP_HEADER header;
+        if (decode_header(message, self->msgs[msg_idx].msg_len, &header) < 0 || header.type != DATA_MSG) {
+            continue;
+        }
+        peers[batch_idx] = open_peer(sock_index, addr);
+        if (peers[batch_idx] < 0) {
+            TRACE("R: No room left for a new peer of socket %d\n", sock_index);
+        } else {
+            // Announced once the lock is released
+            opened_msgs[opened_count] = msg_idx;
+            opened_peers[opened_count++] = peers[batch_idx];
+        }
+    }
+    
+    // Process the messages of each peer together, in the order they arrived
+    int readable = 0, locked = 1;
+    int64_t now = monotonic_ns();
+    for (int batch_idx = 0; batch_idx < count; batch_idx++) {
+        int peer = peers[batch_idx];
+        if (peer < 0) {
+            continue;
+        }
+        int peer_msgs[IMPAIRED_BATCH], peer_count = 0;
+        for (int later_idx = batch_idx; later_idx < count; later_idx++) {
+            if (peers[later_idx] == peer) {
+                peer_msgs[peer_count++] = msg_idxs[later_idx];
+                peers[later_idx] = -1;
+            }
+        }
         
-        P(semid_shared_mem);
-        for (int socket_idx = 0; socket_idx < N; socket_idx++) {
-            if (!shared_mem[socket_idx].sock_info.free) {
-                // Add socket to read set
-                FD_SET(shared_mem[socket_idx].sock_info.udp_sockid, &read_fds);
-                if (shared_mem[socket_idx].sock_info.udp_sockid > max_fd) {
-                    max_fd = shared_mem[socket_idx].sock_info.udp_sockid;
-                }
-                
-                // Check if we need to send a window update
-                if (shared_mem[socket_idx].buffer_full == 1 && shared_mem[socket_idx].rwnd.size > 0) {
-                    // Buffer was full but now has space
-                    shared_mem[socket_idx].buffer_full = 0;
-                    
-                    // Send a window update (duplicate ACK)
-                    struct sockaddr_in dest_addr;
-                    memset(&dest_addr, 0, sizeof(dest_addr));
-                    dest_addr.sin_family = AF_INET;
-                    dest_addr.sin_port = htons(shared_mem[socket_idx].sock_info.port);
-                    inet_pton(AF_INET, shared_mem[socket_idx].sock_info.ip_addr, &(dest_addr.sin_addr));
-                    
-                    // Last acknowledged sequence number
-                    int last_ack = (shared_mem[socket_idx].rwnd.start - 1 + MAX_SEQ_NUM) % MAX_SEQ_NUM;
-                    
-                    // Send the window update
-                    printf("R: Sending window update for socket %d: ACK=%d rwnd=%d\n", 
-                           socket_idx, last_ack, shared_mem[socket_idx].rwnd.size);
-                    send_ack_message(shared_mem[socket_idx].sock_info.udp_sockid, last_ack, 
-                                   shared_mem[socket_idx].rwnd.size, &dest_addr);
+        if (!locked) {
+            lock_socket(sock_index);
+        }
+        locked = 0;
+        if (find_peer(sock_index, &self->src_addrs[peer_msgs[0]]) != peer) {
+            // k_close released the peer meanwhile, or GC() expired it and its entry
+            // may already serve another address
+            unlock_socket(sock_index);
+            continue;
+        }
+        socket_state(peer)->last_active = now;
+        readable |= process_messages(self, peer, udp_sockid, peer_msgs, peer_count);
+    }
+    if (locked) {
+        unlock_socket(sock_index);
+    }
+    for (int opened_idx = 0; opened_idx < opened_count; opened_idx++) {
+        const struct sockaddr_in *addr = &self->src_addrs[opened_msgs[opened_idx]];
+        char ip_addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, ip_addr, INET_ADDRSTRLEN);
+        printf("R: New peer %s:%d of socket %d is peer %d\n",
+               ip_addr, ntohs(addr->sin_port), sock_index, PEER_INDEX(opened_peers[opened_idx]));
+    }
+    
+    if (readable) {
+        lock_socket(sock_index);
+        shared_mem[sock_index].recv_event++;
+        int wake_recv = shared_mem[sock_index].recv_waiters > 0;
+        unlock_socket(sock_index);
+        if (wake_recv) {
+            wake_socket_event(&shared_mem[sock_index].recv_event);
+        }
+    }
+}
+
+// Process the messages of the current batch listed in msg_idxs, received on udp_sockid,
+// for sock_index or its peers (caller holds the socket lock, which is released here)
+static void deliver_messages(struct worker *self, int sock_index, int udp_sockid, const int *msg_idxs, int count) {
+    if (!socket_state(sock_index)->sock_info.unconnected) {
+        process_messages(self, sock_index, udp_sockid, msg_idxs, count);
+    } else {
+        receive_from_peers(self, sock_index, udp_sockid, msg_idxs, count);
+    }
+}
+
+// Arm timer_fd for the earliest held packet, or disarm it if none is left
+static void arm_release_timer(struct worker *self) {
+    int64_t due = (self->held_count > 0) ? self->held[self->held_heap[0]].release : 0;
+    if (due == self->timer_due) {
+        return;
+    }
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = due / NSEC_PER_SEC;
+    timer.it_value.tv_nsec = due % NSEC_PER_SEC;
+    if (timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+        perror("timerfd_settime() error");
+    }
+    self->timer_due = due;
+}
+
+/* Process the held packets whose release time has come, a batch at a time with the
+ * packets of each socket together, then arm timer_fd for the rest. Packets of a socket
+ * closed or reused meanwhile are dropped */
+static void release_held_packets(struct worker *self) {
+    int64_t now = monotonic_ns();
+    while (self->held_count > 0 && self->held[self->held_heap[0]].release <= now) {
+        int sockets[RECV_BATCH], udp_sockids[RECV_BATCH], received = 0;
+        while (received < RECV_BATCH && self->held_count > 0 && self->held[self->held_heap[0]].release <= now) {
+            const struct held_packet *packet = &self->held[pop_held(self)];
+            memcpy(self->message_buffers[received], packet->data, packet->len);
+            self->msgs[received].msg_len = packet->len;
+            self->msgs[received].msg_hdr.msg_namelen = packet->addr_len;
+            self->src_addrs[received] = packet->src_addr;
+            sockets[received] = packet->sock_index;
+            udp_sockids[received] = packet->udp_sockid;
+            received++;
+        }
+        
+        for (int msg_idx = 0; msg_idx < received; msg_idx++) {
+            int sock_index = sockets[msg_idx], udp_sockid = udp_sockids[msg_idx];
+            if (sock_index < 0) {
+                continue;
+            }
+            int msg_idxs[RECV_BATCH], count = 0;
+            for (int later_idx = msg_idx; later_idx < received; later_idx++) {
+                if (sockets[later_idx] == sock_index && udp_sockids[later_idx] == udp_sockid) {
+                    msg_idxs[count++] = later_idx;
+                    sockets[later_idx] = -1;
                 }
             }
+            
+            lock_socket(sock_index);
+            if (socket_state(sock_index)->sock_info.free ||
+                socket_state(sock_index)->sock_info.udp_sockid != udp_sockid) {
+                unlock_socket(sock_index);
+                continue;
+            }
+            deliver_messages(self, sock_index, udp_sockid, msg_idxs, count);
+        }
+    }
+    arm_release_timer(self);
+}
+
+// Receiver thread function (R) of a worker
+void *R(void *arg) {
+    struct worker *self = arg;
+    printf("Starting receiver thread of worker %d on CPU %d\n", self->index, self->cpu);
+    struct epoll_event events[R_EVENT_BATCH];
+    struct iovec msg_iovs[RECV_BATCH];
+    int msg_idxs[IMPAIRED_BATCH];
+    
+    while(1) {
+        // Sleep until a bound socket has a message or a held packet is due; window
+        // updates are sent by S()
+        int ready = epoll_wait(self->epoll_fd, events, R_EVENT_BATCH, -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait() error");
+            }
+            continue;
         }
         
         // Process any incoming messages
-        if (select_result > 0) {
-            for (int socket_idx = 0; socket_idx < N; socket_idx++) {
-                if (!shared_mem[socket_idx].sock_info.free && 
-                    FD_ISSET(shared_mem[socket_idx].sock_info.udp_sockid, &temp_fds)) {
-                    // Buffer for incoming message
-                    char *message_buffer = malloc(MAX_MSG_SIZE + 20);
-                    if (!message_buffer) {
-                        perror("Memory allocation failed");
-                        continue;
-                    }
-                    
-                    // Receive message
-                    struct sockaddr_in src_addr;
-                    socklen_t addr_len = sizeof(src_addr);
-                    int bytes_received = recvfrom(shared_mem[socket_idx].sock_info.udp_sockid, 
-                                             message_buffer, MAX_MSG_SIZE + 20, 0,
-                                             (struct sockaddr*)&src_addr, &addr_len);
-                    
-                    if (bytes_received <= 0) {
-                        perror("recvfrom() error");
-                        free(message_buffer);
-                        continue;
-                    }
-                    
-                    // Simulate message loss
-                    if (dropMessage(DROP_PROB)) {
-                        printf("R: Dropped message for socket %d\n", socket_idx);
-                        free(message_buffer);
-                        continue;
-                    }
-                    
-                    // Process based on message type
-                    if (bytes_received > 0) {
-                        if (message_buffer[0] == DATA_MSG) {
-                            process_data_message(socket_idx, message_buffer, bytes_received, &src_addr);
-                        } else if (message_buffer[0] == ACK_MSG) {
-                            process_ack_message(socket_idx, message_buffer);
-                        } else {
-                            printf("R: Received unknown message type: %c\n", message_buffer[0]);
-                        }
-                    }
-                    
-                    free(message_buffer);
+        for (int event_idx = 0; event_idx < ready; event_idx++) {
+            uint32_t socket_idx = (uint32_t)events[event_idx].data.u64;
+            int udp_sockid = (int)(events[event_idx].data.u64 >> 32);
+            if (socket_idx == RELEASE_EVENT) {
+                uint64_t expirations;
+                if (read(self->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("timerfd read() error");
                 }
+                self->timer_due = 0;  // Expired, arm it again below
+                continue;
             }
+            
+            // Drain up to RECV_BATCH queued messages without holding the socket lock;
+            // epoll reports the socket again if more are left
+            for (int msg_idx = 0; msg_idx < RECV_BATCH; msg_idx++) {
+                prepare_message(&self->msgs[msg_idx], &msg_iovs[msg_idx], self->message_buffers[msg_idx],
+                                sizeof(self->message_buffers[msg_idx]), &self->src_addrs[msg_idx],
+                                sizeof(self->src_addrs[msg_idx]));
+            }
+            int received = recvmmsg(udp_sockid, self->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+            if (received <= 0) {
+                // EBADF: k_close had the socket closed after the event was reported
+                if (errno != EBADF && errno != EAGAIN) {
+                    perror("recvmmsg() error");
+                }
+                continue;
+            }
+            
+            // Impair and process the whole batch under one lock
+            lock_socket(socket_idx);
+            // Skip the messages if the socket was closed or reused while we were receiving
+            if (shared_mem[socket_idx].sock_info.free || 
+                shared_mem[socket_idx].sock_info.udp_sockid != udp_sockid) {
+                unlock_socket(socket_idx);
+                continue;
+            }
+            int count = impair_messages(self, socket_idx, udp_sockid, received, msg_idxs);
+            deliver_messages(self, socket_idx, udp_sockid, msg_idxs, count);
         }
         
-        V(semid_shared_mem);
+        // The message buffers are free again for the held packets that are due
+        release_held_packets(self);
     }
     
     return NULL;
 }
 
-// Sender thread function (S)
-void *S() {
-    printf("Starting sender thread\n");
+// Wait until a worker's doorbell is rung or the deadline (CLOCK_MONOTONIC ns) passes;
+// returns 1 if rung
+static int wait_doorbell(int worker_idx, int64_t deadline) {
+    struct sembuf sop;
+    sop.sem_num = worker_idx;
+    sop.sem_op = -1;
+    sop.sem_flg = 0;
+    
+    int64_t remaining = deadline - monotonic_ns();
+    if (remaining <= 0) {
+        return 0;
+    }
+    struct timespec timeout;
+    timeout.tv_sec = remaining / NSEC_PER_SEC;
+    timeout.tv_nsec = remaining % NSEC_PER_SEC;
+    
+    // EAGAIN means the timer expired, EINTR is treated the same way
+    return semtimedop(semid_doorbell, &sop, 1, &timeout) == 0;
+}
+
+// Stage and send the new data, window updates and retransmissions of a socket or peer,
+// pulling next_check in to the earliest timer that was started; on a timer pass a full
+// receive window is probed too. Free and half-created sockets have no buffers, and any
+// stale mapping is dropped (caller holds the socket lock, which is released here)
+static void transmit_socket(int sockfd, struct tx_batch *batch, int timers, int64_t *next_check) {
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL) {
+        unlock_socket(sockfd);
+        return;
+    }
+    
+    // Retransmit only the packets whose timers expired, then send new ones
+    prepare_tx_batch(sockfd, batch);
+    stage_window_update(sockfd, bufs, batch);
+    stage_delayed_ack(sockfd, bufs, batch);
+    flush_stream_tail(sockfd, bufs, batch);
+    fast_retransmit(sockfd, bufs, batch);
+    tail_loss_probe(sockfd, bufs, batch);
+    retransmit_packets(sockfd, bufs, batch);
+    transmit_new_packets(sockfd, bufs, batch);
+    if (timers) {
+        probe_zero_window(sockfd, bufs, batch);
+    }
+    unlock_socket(sockfd);
+    
+    if (batch->next_deadline < *next_check) {
+        *next_check = batch->next_deadline;
+    }
+    flush_tx_batch(batch);
+}
+
+// Transmit for the peers of the unconnected socket sockfd, on a timer pass for all of
+// them and otherwise for those that rang the doorbell. They are picked out first so
+// that each takes the lock once more (caller holds the socket lock, which is released here)
+static void transmit_peers(int worker_idx, int sockfd, struct tx_batch *batch, int timers, int64_t *next_check) {
+    int peers[MAX_PEERS], count = 0;
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        SHARED_MEMORY *peer = socket_state(PEER_SOCKET(sockfd, peer_idx));
+        if (!peer->sock_info.free && (timers || peer->tx_pending)) {
+            peer->tx_pending = 0;
+            peers[count++] = peer_idx;
+        }
+    }
+    unlock_socket(sockfd);
+    
+    for (int pick_idx = 0; pick_idx < count; pick_idx++) {
+        int peer = PEER_SOCKET(sockfd, peers[pick_idx]);
+        lock_socket(peer);
+        // k_close may have released the peers meanwhile; a peer GC() expired is free too
+        if (socket_state(peer)->sock_info.free || shared_mem[sockfd].sock_info.worker != worker_idx) {
+            unlock_socket(peer);
+            continue;
+        }
+        transmit_socket(peer, batch, timers, next_check);
+    }
+}
+
+// Send new data and window updates for every socket that rang the doorbell, pulling next_check in to
+// the earliest timer that was started. Messages whose timers expired while the
+// congestion window kept them back are resent as soon as ACKs open it again
+static void transmit_pending_sockets(int worker_idx, struct tx_batch *batch, int64_t *next_check) {
+    for (int socket_idx = 0; socket_idx < N; socket_idx++) {
+        // sock_info.worker only changes when the slot is created again, so sockets of other
+        // workers are skipped without taking their locks; it is checked again under the lock
+        if (shared_mem[socket_idx].sock_info.worker != worker_idx) {
+            continue;
+        }
+        lock_socket(socket_idx);
+        if (!shared_mem[socket_idx].tx_pending || shared_mem[socket_idx].sock_info.worker != worker_idx) {
+            unlock_socket(socket_idx);
+            continue;
+        }
+        shared_mem[socket_idx].tx_pending = 0;
+        if (shared_mem[socket_idx].sock_info.unconnected) {
+            transmit_peers(worker_idx, socket_idx, batch, 0, next_check);
+        } else {
+            transmit_socket(socket_idx, batch, 0, next_check);
+        }
+    }
+}
+
+// Name of a socket in the reports, "3" or for a peer of an unconnected socket "3.17"
+static const char *report_name(int sockfd, char *name, size_t size) {
+    if (IS_PEER(sockfd)) {
+        snprintf(name, size, "%d.%d", PARENT_SOCKET(sockfd), PEER_INDEX(sockfd));
+    } else {
+        snprintf(name, size, "%d", sockfd);
+    }
+    return name;
+}
+
+// Sockets the reports cover for the slot socket_idx: itself, or its peer entries if it
+// is unconnected, expired ones included. Returns their number, 0 for a free slot
+// (caller holds the socket lock)
+static int report_sockets(int socket_idx, int *first) {
+    if (shared_mem[socket_idx].sock_info.free) {
+        return 0;
+    }
+    if (!shared_mem[socket_idx].sock_info.unconnected) {
+        *first = socket_idx;
+        return 1;
+    }
+    *first = PEER_SOCKET(socket_idx, 0);
+    return shared_mem[socket_idx].sock_info.peers;
+}
+
+/* Print the throughput of every active socket over the last period and, for each
+ * algorithm with at least one active socket, Jain's fairness index of their
+ * throughputs: 1.0 when all sockets got the same share, 1/n when one got all */
+static void report_congestion(double period) {
+    double rate_sum[CC_COUNT] = {0}, rate_squares[CC_COUNT] = {0};
+    int active[CC_COUNT] = {0};
+    char name[32];
+    
+    for (int socket_idx = 0; socket_idx < N; socket_idx++) {
+        lock_socket(socket_idx);
+        int first, count = report_sockets(socket_idx, &first);
+        for (int sockfd = first; sockfd < first + count; sockfd++) {
+            struct cong_info *cc = &socket_state(sockfd)->cc;
+            if (socket_state(sockfd)->sock_info.free || cc->delivered == cc->reported) {
+                continue;
+            }
+            double rate = (cc->delivered - cc->reported) / period;
+            cc->reported = cc->delivered;
+            printf("CC: socket %s %s %.1f msg/s cwnd=%d ssthresh=%d delivered=%llu losses=%u timeouts=%u "
+                   "fast_retransmits=%u tail_probes=%u\n",
+                   report_name(sockfd, name, sizeof(name)), cc_name(cc->algorithm), rate, cc->cwnd,
+                   cc->ssthresh, (unsigned long long)cc->delivered, cc->loss_events, cc->timeouts,
+                   socket_state(sockfd)->loss.fast_retransmits, socket_state(sockfd)->loss.tail_probes);
+            rate_sum[cc->algorithm] += rate;
+            rate_squares[cc->algorithm] += rate * rate;
+            active[cc->algorithm]++;
+        }
+        unlock_socket(socket_idx);
+    }
+    
+    for (int algorithm = 0; algorithm < CC_COUNT; algorithm++) {
+        if (active[algorithm] > 0) {
+            printf("CC: %s: %d sockets, %.1f msg/s total, fairness %.3f\n", cc_name(algorithm),
+                   active[algorithm], rate_sum[algorithm],
+                   rate_sum[algorithm] * rate_sum[algorithm] / (active[algorithm] * rate_squares[algorithm]));
+        }
+    }
+}
+
+// Print the ACKs sent per DATA packet received of every socket that received data
+// over the last period; about 1 / ACK_EVERY with delayed ACKs, 1 without
+static void report_acks(void) {
+    char name[32];
+    for (int socket_idx = 0; socket_idx < N; socket_idx++) {
+        lock_socket(socket_idx);
+        int first, count = report_sockets(socket_idx, &first);
+        for (int sockfd = first; sockfd < first + count; sockfd++) {
+            struct ack_info *ack = &socket_state(sockfd)->ack;
+            if (socket_state(sockfd)->sock_info.free || ack->data_received == ack->reported) {
+                continue;
+            }
+            ack->reported = ack->data_received;
+            printf("ACK: socket %s delay=%lldus data=%llu acks=%llu ratio=%.3f\n",
+                   report_name(sockfd, name, sizeof(name)), (long long)(ack->delay / 1000),
+                   (unsigned long long)ack->data_received, (unsigned long long)ack->acks_sent,
+                   (double)ack->acks_sent / ack->data_received);
+        }
+        unlock_socket(socket_idx);
+    }
+}
+
+// Sender thread function (S) of a worker
+void *S(void *arg) {
+    struct worker *self = arg;
+    printf("Starting sender thread of worker %d on CPU %d\n", self->index, self->cpu);
+    
+    // Staging area for one socket's packets, reused across sockets
+    struct tx_batch *batch = &self->batch;
+    int64_t next_check = monotonic_ns() + T * NSEC_PER_SEC / 2;
+    int64_t next_report = monotonic_ns() + CC_REPORT_PERIOD * NSEC_PER_SEC;
     
     while(1) {
-        // Periodically check for timeouts and send new messages
-        sleep(T/2);
+        // Send new messages as soon as k_sendto or an ACK rings the doorbell
+        if (wait_doorbell(self->index, next_check)) {
+            transmit_pending_sockets(self->index, batch, &next_check);
+            continue;
+        }
         
-        P(semid_shared_mem);
+        // Check for timeouts when the earliest timer expires, at least every T/2.
+        // The first worker reports on all sockets
+        int64_t now = monotonic_ns();
+        if (self->index == 0 && now >= next_report) {
+            report_congestion((double)(now - next_report) / NSEC_PER_SEC + CC_REPORT_PERIOD);
+            report_acks();
+            next_report = now + CC_REPORT_PERIOD * NSEC_PER_SEC;
+        }
+        next_check = now + T * NSEC_PER_SEC / 2;
+        next_check = (next_report < next_check) ? next_report : next_check;
         
-        // Check each active socket
+        // Check each active socket of this worker, skipping the others without their locks
         for (int socket_idx = 0; socket_idx < N; socket_idx++) {
-            if (!shared_mem[socket_idx].sock_info.free) {
-                // Check for timeouts
-                int timeout_detected = 0;
-                time_t current_time = time(NULL);
-                
-                // Iterate through send window
-                for (int win_idx = 0; win_idx < shared_mem[socket_idx].swnd.size; win_idx++) {
-                    int seq_num = (shared_mem[socket_idx].swnd.start + win_idx) % MAX_SEQ_NUM;
-                    
-                    // Check if this packet was sent and timed out
-                    if (shared_mem[socket_idx].send_info.timestamps[seq_num] > 0 && 
-                        (current_time - shared_mem[socket_idx].send_info.timestamps[seq_num] >= T)) {
-                        timeout_detected = 1;
-                        break;
-                    }
-                }
-                
-                if (timeout_detected) {
-                    // Retransmit all unacknowledged packets
-                    printf("S: Timeout detected for socket %d\n", socket_idx);
-                    retransmit_packets(socket_idx);
-                } else {
-                    // Send any new packets that are in the window but not yet sent
-                    transmit_new_packets(socket_idx);
-                }
+            if (shared_mem[socket_idx].sock_info.worker != self->index) {
+                continue;
+            }
+            lock_socket(socket_idx);
+            if (shared_mem[socket_idx].sock_info.worker != self->index) {
+                unlock_socket(socket_idx);
+                continue;
+            }
+            shared_mem[socket_idx].tx_pending = 0;
+            if (!shared_mem[socket_idx].sock_info.free && shared_mem[socket_idx].sock_info.unconnected) {
+                transmit_peers(self->index, socket_idx, batch, 1, &next_check);
+            } else {
+                transmit_socket(socket_idx, batch, 1, &next_check);
             }
         }
-        
-        V(semid_shared_mem);
     }
     
     return NULL;
@@ -565,16 +1784,18 @@ void *S() {
 // Initialize IPC resources
 static void initialize_ipc_resources() {
     // Generate unique keys for IPC resources
-    key_t ipc_keys[6];
+    key_t ipc_keys[8];
     ipc_keys[0] = ftok("/etc/hosts", 'A');  
     ipc_keys[1] = ftok("/etc/hosts", 'B');
     ipc_keys[2] = ftok("/etc/hosts", 'C');
     ipc_keys[3] = ftok("/etc/hosts", 'D');
     ipc_keys[4] = ftok("/etc/hosts", 'E');
     ipc_keys[5] = ftok("/etc/hosts", 'F');
+    ipc_keys[6] = ftok("/etc/hosts", 'G');
+    ipc_keys[7] = ftok("/etc/hosts", 'H');
     
     // Create shared memory segments
-    shmid_net_socket = shmget(ipc_keys[0], sizeof(NET_SOCKET), 0666 | IPC_CREAT);
+    shmid_net_socket = shmget(ipc_keys[0], sizeof(REQUEST_QUEUE), 0666 | IPC_CREAT);
     shmid_shared_mem = shmget(ipc_keys[2], sizeof(SHARED_MEMORY) * N, 0666 | IPC_CREAT);
     
     if (shmid_net_socket < 0 || shmid_shared_mem < 0) {
@@ -584,36 +1805,79 @@ static void initialize_ipc_resources() {
     
     // Create semaphores
     semid_net_socket = semget(ipc_keys[1], 1, 0666 | IPC_CREAT);
-    semid_shared_mem = semget(ipc_keys[3], 1, 0666 | IPC_CREAT);
+    semid_shared_mem = semget(ipc_keys[3], N, 0666 | IPC_CREAT);
     semid_init = semget(ipc_keys[4], 1, 0666 | IPC_CREAT);
-    semid_ktp = semget(ipc_keys[5], 1, 0666 | IPC_CREAT);
+    semid_ktp = semget(ipc_keys[5], N, 0666 | IPC_CREAT);
+    semid_alloc = semget(ipc_keys[6], 1, 0666 | IPC_CREAT);
+    semid_doorbell = semget(ipc_keys[7], MAX_WORKERS, 0666 | IPC_CREAT);
     
     if (semid_net_socket < 0 || semid_shared_mem < 0 || 
-        semid_init < 0 || semid_ktp < 0) {
+        semid_init < 0 || semid_ktp < 0 || semid_alloc < 0 || semid_doorbell < 0) {
         fprintf(stderr, "Failed to create semaphores: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     
     // Initialize semaphores
+    unsigned short socket_locks[N], request_replies[N];
+    for (int socket_idx = 0; socket_idx < N; socket_idx++) {
+        socket_locks[socket_idx] = 1;
+        request_replies[socket_idx] = 0;
+    }
     semctl(semid_net_socket, 0, SETVAL, 1);
-    semctl(semid_shared_mem, 0, SETVAL, 1);
+    semctl(semid_shared_mem, 0, SETALL, socket_locks);
     semctl(semid_init, 0, SETVAL, 0);
-    semctl(semid_ktp, 0, SETVAL, 0);
+    semctl(semid_ktp, 0, SETALL, request_replies);
+    semctl(semid_alloc, 0, SETVAL, 1);
+    unsigned short doorbells[MAX_WORKERS] = {0};
+    semctl(semid_doorbell, 0, SETALL, doorbells);
     
     // Attach to shared memory
     shared_mem = (SHARED_MEMORY *)shmat(shmid_shared_mem, NULL, 0);
-    net_socket = (NET_SOCKET *)shmat(shmid_net_socket, NULL, 0);
+    request_queue = (REQUEST_QUEUE *)shmat(shmid_net_socket, NULL, 0);
     
-    if (shared_mem == (void *)-1 || net_socket == (void *)-1) {
+    if (shared_mem == (void *)-1 || request_queue == (void *)-1) {
         fprintf(stderr, "Failed to attach shared memory: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     
     // Initialize shared memory
-    memset(net_socket, 0, sizeof(NET_SOCKET));
+    memset(request_queue, 0, sizeof(REQUEST_QUEUE));  // Every slot REQUEST_EMPTY
     
     for (int socket_idx = 0; socket_idx < N; socket_idx++) {
         shared_mem[socket_idx].sock_info.free = 1;
+        shared_mem[socket_idx].sock_info.buf_shmid = -1;
+        shared_mem[socket_idx].sock_info.worker = 0;
+        shared_mem[socket_idx].sock_info.unconnected = 0;
+        shared_mem[socket_idx].sock_info.peers = 0;
+        shared_mem[socket_idx].sock_info.free_peers = 0;
+        shared_mem[socket_idx].tx_pending = 0;
+    }
+    
+    // Each worker's R() waits on its own set instead of scanning every slot
+    for (int worker_idx = 0; worker_idx < worker_count; worker_idx++) {
+        workers[worker_idx].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[worker_idx].epoll_fd < 0) {
+            fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        
+        // ... including the timer of the packets its impairment stage holds back
+        struct worker *worker = &workers[worker_idx];
+        worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t)(uint32_t)worker->timer_fd << 32) | RELEASE_EVENT;
+        if (worker->timer_fd < 0 || epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->timer_fd, &event) < 0) {
+            fprintf(stderr, "Failed to create release timer: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        worker->timer_due = 0;
+        worker->held_count = 0;
+        worker->held_order = 0;
+        for (int slot = 0; slot < IMPAIR_QUEUE_SIZE; slot++) {
+            worker->free_held[slot] = slot;
+        }
+        worker->free_count = IMPAIR_QUEUE_SIZE;
     }
     
     printf("IPC resources initialized successfully\n");
@@ -631,24 +1895,15 @@ static void cleanup_ipc_resources() {
                 close(shared_mem[socket_idx].sock_info.udp_sockid);
                 printf("Closed UDP socket %d\n", shared_mem[socket_idx].sock_info.udp_sockid);
             }
+            if (!shared_mem[socket_idx].sock_info.free && shared_mem[socket_idx].sock_info.buf_shmid >= 0) {
+                // Threads may still touch the mapping; it is dropped at exit
+                shmctl(shared_mem[socket_idx].sock_info.buf_shmid, IPC_RMID, NULL);
+            }
         }
     }
     
-    // Detach from shared memory
-    printf("Detaching from shared memory...\n");
-    if (shared_mem != NULL) {
-        if (shmdt(shared_mem) == -1) {
-            perror("Failed to detach from shared memory (shared_mem)");
-        }
-        shared_mem = NULL;
-    }
-    
-    if (net_socket != NULL) {
-        if (shmdt(net_socket) == -1) {
-            perror("Failed to detach from shared memory (net_socket)");
-        }
-        net_socket = NULL;
-    }
+    // The segments stay attached: pthread_cancel() does not wait for R(), S() and GC(),
+    // which may still be using them. The mappings are dropped when the process exits
     
     // Remove shared memory segments
     printf("Removing shared memory segments...\n");
@@ -675,6 +1930,20 @@ static void cleanup_ipc_resources() {
         semid_shared_mem = -1;
     }
     
+    if (semid_alloc >= 0) {
+        if (semctl(semid_alloc, 0, IPC_RMID) == -1) {
+            perror("Failed to remove semaphore (alloc)");
+        }
+        semid_alloc = -1;
+    }
+    
+    if (semid_doorbell >= 0) {
+        if (semctl(semid_doorbell, 0, IPC_RMID) == -1) {
+            perror("Failed to remove semaphore (doorbell)");
+        }
+        semid_doorbell = -1;
+    }
+    
     if (semid_net_socket >= 0) {
         if (semctl(semid_net_socket, 0, IPC_RMID) == -1) {
             perror("Failed to remove semaphore (net_socket)");
@@ -708,8 +1977,10 @@ void sigHandler(int sig) {
         terminate_flag = 1;
         
         // Cancel threads first to prevent them from using resources while we're cleaning up
-        pthread_cancel(receiver_thread);
-        pthread_cancel(sender_thread);
+        for (int worker_idx = 0; worker_idx < worker_count; worker_idx++) {
+            pthread_cancel(workers[worker_idx].receiver_thread);
+            pthread_cancel(workers[worker_idx].sender_thread);
+        }
         pthread_cancel(gc_thread);
         
         // Clean up resources
@@ -720,13 +1991,59 @@ void sigHandler(int sig) {
     }
 }
 
+// Start the R() and S() threads of a worker, both pinned to its core
+static int start_worker(struct worker *worker, pthread_attr_t *attr) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    
+    if (pthread_create(&worker->receiver_thread, attr, R, worker) != 0) {
+        perror("Failed to create receiver thread");
+        return -1;
+    }
+    if (pthread_create(&worker->sender_thread, attr, S, worker) != 0) {
+        perror("Failed to create sender thread");
+        return -1;
+    }
+    return 0;
+}
+
 // Main function to initialize KTP socket system
-int main() {
+// Usage: initksocket [-v] [-I impairment] [workers], one worker per online core (up to
+// MAX_WORKERS) by default
+int main(int argc, char *argv[]) {
     // Set up signal handler
     signal(SIGINT, sigHandler);
     
-    // Seed random number generator for dropout simulation
-    srand(time(NULL) ^ getpid());
+    // -I sets the impairment every new socket starts with, none by default
+    struct ktp_impairment impairment;
+    impairment_defaults(&impairment);
+    int opt, usage_error = 0;
+    while ((opt = getopt(argc, argv, "vI:")) != -1) {
+        if (opt == 'v') {
+            verbose = 1;  // Trace every packet
+        } else if (opt != 'I' || k_parse_impairment(optarg, &impairment) < 0) {
+            usage_error = 1;
+        }
+    }
+    
+    // Shard the sockets across the requested number of workers
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_count = (cpu_count < 1) ? 1 : cpu_count;
+    worker_count = (optind < argc) ? atoi(argv[optind]) : (int)cpu_count;
+    if (worker_count < 1 || worker_count > MAX_WORKERS) {
+        worker_count = (optind < argc) ? 0 : MAX_WORKERS;
+    }
+    if (worker_count == 0 || usage_error) {
+        fprintf(stderr, "Usage: %s [-v] [-I impairment] [workers], with 1 to %d workers\n", argv[0], MAX_WORKERS);
+        fprintf(stderr, "-v traces every packet; the impairment is as for ktp_bench -I, e.g. -I loss=0.05\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int worker_idx = 0; worker_idx < worker_count; worker_idx++) {
+        workers[worker_idx].index = worker_idx;
+        workers[worker_idx].cpu = worker_idx % cpu_count;
+    }
     
     // Initialize semaphore operations
     sem_decrement.sem_num = 0;
@@ -739,6 +2056,7 @@ int main() {
     
     // Initialize IPC resources
     initialize_ipc_resources();
+    request_queue->impairment = impairment;
     
     // Create threads
     pthread_attr_t attr;
@@ -746,21 +2064,18 @@ int main() {
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     
-    // Create receiver thread
-    if (pthread_create(&receiver_thread, &attr, R, NULL) != 0) {
-        perror("Failed to create receiver thread");
-        cleanup_ipc_resources();
-        exit(EXIT_FAILURE);
-    }
-    
-    // Create sender thread
-    if (pthread_create(&sender_thread, &attr, S, NULL) != 0) {
-        perror("Failed to create sender thread");
-        cleanup_ipc_resources();
-        exit(EXIT_FAILURE);
+    // Create the receiver and sender threads of every worker
+    for (int worker_idx = 0; worker_idx < worker_count; worker_idx++) {
+        if (start_worker(&workers[worker_idx], &attr) < 0) {
+            cleanup_ipc_resources();
+            exit(EXIT_FAILURE);
+        }
     }
     
-    // Create garbage collector thread
+    // Create garbage collector thread, which may run on any core
+    pthread_attr_destroy(&attr);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     if (pthread_create(&gc_thread, &attr, GC, NULL) != 0) {
         perror("Failed to create garbage collector thread");
         cleanup_ipc_resources();
@@ -769,7 +2084,7 @@ int main() {
     
     pthread_attr_destroy(&attr);
     
-    printf("KTP initialization complete. All threads started.\n");
+    printf("KTP initialization complete. All threads of %d workers started.\n", worker_count);
     printf("Press Ctrl+C to terminate the program.\n");
     
     // Main thread handles socket creation and binding
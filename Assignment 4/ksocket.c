@@ -4,73 +4,403 @@
  Roll number: 22CS30011
 ============================================*/
 
+#include <limits.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "ksocket.h"
 
 // Global variable definitions - visible to all files including ksocket.h
 SHARED_MEMORY *shared_mem = NULL;
-NET_SOCKET *net_socket = NULL;
+REQUEST_QUEUE *request_queue = NULL;
 int semid_shared_mem = -1, semid_net_socket = -1;
 int shmid_shared_mem = -1, shmid_net_socket = -1;
 int semid_init = -1, semid_ktp = -1;
+int semid_alloc = -1;
+int semid_doorbell = -1;
 struct sembuf sem_decrement, sem_increment;
 
+// Buffer segments attached by this process, indexed by KTP socket (guarded by the socket lock)
+static SOCKET_BUFFERS attached_buffers[N];
+
+// Attaches the IPC resources the first time any thread of the process needs them
+static pthread_once_t attach_once = PTHREAD_ONCE_INIT;
+
 // Local helper function prototypes
 static int find_free_socket_slot(void);
 static int find_process_socket(void);
-static int find_free_buffer_slot(int sockfd);
 static int check_destination_match(int sockfd, const char* dest_ip, uint16_t dest_port);
+static int submit_request(int socket_idx, NET_SOCKET *request);
 
-// Connect to shared memory segments and semaphores
-void retrieve_SHARED_MEMORY() {
+// Setup semaphore operation structures
+void init_sembuf() {
+    // Initialize "P" operation (decrement)
+    sem_decrement.sem_num = 0;
+    sem_decrement.sem_op = -1;
+    sem_decrement.sem_flg = 0;
+    
+    // Initialize "V" operation (increment)
+    sem_increment.sem_num = 0;
+    sem_increment.sem_op = 1;
+    sem_increment.sem_flg = 0;
+}
+
+// Detach every segment this process attached, run at exit
+static void detach_shared_memory(void) {
+    for (int socket_idx = 0; socket_idx < N; socket_idx++) {
+        release_socket_buffers(socket_idx);
+    }
+    shmdt(shared_mem);
+    shmdt(request_queue);
+    shared_mem = NULL;
+    request_queue = NULL;
+}
+
+/* Connect to shared memory segments and semaphores, once per process. A child
+ * created by fork() inherits the attachments, identifiers and the detach
+ * handler, so it needs nothing of its own */
+static void attach_shared_memory(void) {
     // Generate unique keys for IPC objects using different paths for uniqueness
-    key_t ipc_keys[6];
+    key_t ipc_keys[8];
     ipc_keys[0] = ftok("/etc/hosts", 'A');  
     ipc_keys[1] = ftok("/etc/hosts", 'B');
     ipc_keys[2] = ftok("/etc/hosts", 'C');
     ipc_keys[3] = ftok("/etc/hosts", 'D');
     ipc_keys[4] = ftok("/etc/hosts", 'E');
     ipc_keys[5] = ftok("/etc/hosts", 'F');
+    ipc_keys[6] = ftok("/etc/hosts", 'G');
+    ipc_keys[7] = ftok("/etc/hosts", 'H');
     
     // Get existing IPC identifiers
-    shmid_net_socket = shmget(ipc_keys[0], sizeof(NET_SOCKET), 0666);
+    shmid_net_socket = shmget(ipc_keys[0], sizeof(REQUEST_QUEUE), 0666);
     semid_net_socket = semget(ipc_keys[1], 1, 0666);
     shmid_shared_mem = shmget(ipc_keys[2], sizeof(SHARED_MEMORY) * N, 0666);
-    semid_shared_mem = semget(ipc_keys[3], 1, 0666);
+    semid_shared_mem = semget(ipc_keys[3], N, 0666);
     semid_init = semget(ipc_keys[4], 1, 0666);
-    semid_ktp = semget(ipc_keys[5], 1, 0666);
+    semid_ktp = semget(ipc_keys[5], N, 0666);
+    semid_alloc = semget(ipc_keys[6], 1, 0666);
+    semid_doorbell = semget(ipc_keys[7], MAX_WORKERS, 0666);
     
     // If any resources not available, print helpful error and exit
     if (shmid_net_socket < 0 || semid_net_socket < 0 || 
         shmid_shared_mem < 0 || semid_shared_mem < 0 || 
-        semid_init < 0 || semid_ktp < 0) {
+        semid_init < 0 || semid_ktp < 0 || semid_alloc < 0 || semid_doorbell < 0) {
         fprintf(stderr, "KTP initialization service not running. Please start initksocket first.\n");
         exit(EXIT_FAILURE);
     }
     
     // Attach to shared memory segments
     shared_mem = (SHARED_MEMORY *)shmat(shmid_shared_mem, NULL, 0);
-    net_socket = (NET_SOCKET *)shmat(shmid_net_socket, NULL, 0);
+    request_queue = (REQUEST_QUEUE *)shmat(shmid_net_socket, NULL, 0);
     
-    if (shared_mem == (void*)-1 || net_socket == (void*)-1) {
+    if (shared_mem == (void*)-1 || request_queue == (void*)-1) {
         perror("Failed to attach to shared memory");
         exit(EXIT_FAILURE);
     }
+    
+    init_sembuf();
+    atexit(detach_shared_memory);
 }
 
-// Setup semaphore operation structures
-void init_sembuf() {
-    // Initialize "P" operation (decrement)
-    sem_decrement.sem_num = 0;
-    sem_decrement.sem_op = -1;
-    sem_decrement.sem_flg = 0;
+// Make sure this process is connected to the KTP IPC resources
+void retrieve_SHARED_MEMORY() {
+    pthread_once(&attach_once, attach_shared_memory);
+}
+
+// Apply a single operation to the semaphore of one KTP socket in a set of N
+static void socket_semop(int semid, int sockfd, short op) {
+    struct sembuf sop;
+    sop.sem_num = sockfd;
+    sop.sem_op = op;
+    sop.sem_flg = 0;
     
-    // Initialize "V" operation (increment)
-    sem_increment.sem_num = 0;
-    sem_increment.sem_op = 1;
-    sem_increment.sem_flg = 0;
+    // Retry if a signal interrupts the wait
+    while (semop(semid, &sop, 1) < 0 && errno == EINTR)
+        ;
+}
+
+// Lock a single KTP socket entry, or the unconnected socket of a peer
+void lock_socket(int sockfd) {
+    socket_semop(semid_shared_mem, PARENT_SOCKET(sockfd), -1);
+}
+
+// Unlock a single KTP socket entry, or the unconnected socket of a peer
+void unlock_socket(int sockfd) {
+    socket_semop(semid_shared_mem, PARENT_SOCKET(sockfd), 1);
+}
+
+// Wake the owner of a KTP socket waiting for the reply to its control request
+void complete_request(int sockfd) {
+    socket_semop(semid_ktp, sockfd, 1);
+}
+
+// Queue a control request in the slot of a KTP socket and wait for initksocket to
+// handle it; the reply is copied back into request. Returns 0 or -1 with errno set
+static int submit_request(int socket_idx, NET_SOCKET *request) {
+    P(semid_net_socket);
+    NET_SOCKET *slot = &request_queue->requests[socket_idx];
+    if (slot->state != REQUEST_EMPTY) {
+        // Another thread of this process has a request in flight for the socket
+        V(semid_net_socket);
+        errno = EBUSY;
+        return -1;
+    }
+    *slot = *request;
+    slot->state = REQUEST_PENDING;
+    slot->ticket = request_queue->next_ticket++;
+    V(semid_net_socket);
+    
+    // Signal init process and wait for the reply in our own slot
+    V(semid_init);
+    socket_semop(semid_ktp, socket_idx, -1);
+    
+    P(semid_net_socket);
+    *request = *slot;
+    slot->state = REQUEST_EMPTY;
+    V(semid_net_socket);
+    
+    if (request->sock_id < 0) {
+        errno = request->err_code;
+        return -1;
+    }
+    return 0;
+}
+
+// Flag a socket as having data for S() to send, and the unconnected socket of a peer
+// as having a peer that does (caller holds the socket lock)
+// Returns 1 if the doorbell has to be rung once the lock is released
+int mark_tx_pending(int sockfd) {
+    if (IS_PEER(sockfd)) {
+        socket_state(sockfd)->tx_pending = 1;
+        sockfd = PARENT_SOCKET(sockfd);
+    }
+    if (shared_mem[sockfd].tx_pending) {
+        return 0;  // S() has not picked up the previous ring yet
+    }
+    shared_mem[sockfd].tx_pending = 1;
+    return 1;
+}
+
+// Wake the S() of the worker serving sockfd so that it transmits pending data without
+// waiting for its timer
+void ring_doorbell(int sockfd) {
+    struct sembuf sop;
+    sop.sem_num = shared_mem[PARENT_SOCKET(sockfd)].sock_info.worker;
+    sop.sem_op = 1;
+    sop.sem_flg = 0;
+    semop(semid_doorbell, &sop, 1);
+}
+
+// Open an update of a socket's stats: seq turns odd, and the stores that follow cannot
+// become visible before it does (caller holds the socket lock)
+void stats_write_begin(int sockfd) {
+    struct ktp_stats *stats = SOCKET_STATS(sockfd);
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-// Find a free socket slot in the shared memory
+// Close an update of a socket's stats: seq turns even once every store before it is visible
+void stats_write_end(int sockfd) {
+    struct ktp_stats *stats = SOCKET_STATS(sockfd);
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Wake every caller sleeping on a socket event (called without the socket lock)
+void wake_socket_event(uint32_t *event) {
+    syscall(SYS_futex, event, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Sleep until a socket event is bumped, the deadline (CLOCK_MONOTONIC ns, 0 for none)
+// passes or a signal arrives. The caller holds the socket lock, which is dropped while
+// sleeping and retaken before returning; returns -1 without sleeping once the deadline
+// has passed. Callers recheck their condition after every return
+static int wait_socket_event(int sockfd, uint32_t *event, int *waiters, int64_t deadline) {
+    struct timespec timeout, *timeout_ptr = NULL;
+    if (deadline != 0) {
+        int64_t remaining = deadline - monotonic_ns();
+        if (remaining <= 0) {
+            return -1;
+        }
+        timeout.tv_sec = remaining / NSEC_PER_SEC;
+        timeout.tv_nsec = remaining % NSEC_PER_SEC;
+        timeout_ptr = &timeout;
+    }
+    
+    uint32_t seen = *event;
+    (*waiters)++;
+    unlock_socket(sockfd);
+    
+    // Returns at once if the event was bumped after the lock was dropped
+    syscall(SYS_futex, event, FUTEX_WAIT, seen, timeout_ptr, NULL, 0);
+    
+    lock_socket(sockfd);
+    (*waiters)--;
+    return 0;
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds, used for all protocol timers
+int64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+// Address of the next array of a segment, which starts on a cache line of its own
+static void *carve_array(char *base, size_t *offset, size_t bytes) {
+    void *array = (base != NULL) ? base + *offset : NULL;
+    *offset += CACHE_ALIGN(bytes);
+    return array;
+}
+
+// Point the fields of bufs at the arrays inside a segment attached at base, returning
+// the size of the segment. Arrays written by the application come first, then those
+// written by initksocket, then the slots, so that they only meet at line boundaries
+static size_t layout_socket_buffers(SOCKET_BUFFERS *bufs, char *base, int send_size, int recv_size) {
+    size_t offset = 0;
+    bufs->send_lengths = carve_array(base, &offset, send_size * sizeof(int));
+    bufs->send_flags = carve_array(base, &offset, send_size * sizeof(int));
+    bufs->recv_active = carve_array(base, &offset, recv_size * sizeof(int));
+    bufs->send_timestamps = carve_array(base, &offset, send_size * sizeof(int64_t));
+    bufs->send_sacked = carve_array(base, &offset, send_size * sizeof(int));
+    bufs->send_retries = carve_array(base, &offset, send_size * sizeof(int));
+    bufs->recv_seqs = carve_array(base, &offset, recv_size * sizeof(uint32_t));
+    bufs->recv_lengths = carve_array(base, &offset, recv_size * sizeof(int));
+    bufs->recv_flags = carve_array(base, &offset, recv_size * sizeof(int));
+    bufs->send_buffer = carve_array(base, &offset, (size_t)send_size * SEND_SLOT_SIZE);
+    bufs->recv_buffer = carve_array(base, &offset, (size_t)recv_size * MAX_MSG_SIZE);
+    return offset;
+}
+
+// Buffer size of the peers of an unconnected socket with a buffer of size messages
+static int peer_buffer_size(int size) {
+    return (size < PEER_BUFFER_SIZE) ? size : PEER_BUFFER_SIZE;
+}
+
+// Bytes of the buffers of one peer of an unconnected socket with the given buffer sizes
+static size_t peer_buffers_size(int send_size, int recv_size) {
+    SOCKET_BUFFERS scratch;
+    return layout_socket_buffers(&scratch, NULL, peer_buffer_size(send_size), peer_buffer_size(recv_size));
+}
+
+/* Point the peer fields of bufs at the part of an unconnected socket's segment behind
+ * its own buffers, which starts at offset: the peer table, the free list, the entries
+ * of MAX_PEERS peers and then their buffers, each laid out like a socket's. Pages of
+ * peers that are never opened are never touched. Returns the size of the segment */
+static size_t layout_peers(SOCKET_BUFFERS *bufs, char *base, size_t offset, int send_size, int recv_size) {
+    bufs->peer_table = carve_array(base, &offset, PEER_TABLE_SIZE * sizeof(int));
+    bufs->peer_free = carve_array(base, &offset, MAX_PEERS * sizeof(int));
+    bufs->peer_states = carve_array(base, &offset, MAX_PEERS * sizeof(SHARED_MEMORY));
+    bufs->peer_area = carve_array(base, &offset, MAX_PEERS * peer_buffers_size(send_size, recv_size));
+    return offset;
+}
+
+// Bytes needed for the buffer segment of a socket with the given buffer sizes, with
+// room for the peers if it is unconnected
+size_t socket_buffers_size(int send_size, int recv_size, int unconnected) {
+    SOCKET_BUFFERS scratch;
+    size_t bytes = layout_socket_buffers(&scratch, NULL, send_size, recv_size);
+    return unconnected ? layout_peers(&scratch, NULL, bytes, send_size, recv_size) : bytes;
+}
+
+// Detach this process from a socket's buffer segment (caller holds the socket lock)
+void release_socket_buffers(int sockfd) {
+    SOCKET_BUFFERS *bufs = &attached_buffers[sockfd];
+    if (bufs->base != NULL) {
+        shmdt(bufs->base);
+        free(bufs->peers);
+        memset(bufs, 0, sizeof(*bufs));
+        bufs->shmid = -1;
+    }
+}
+
+// Buffers of the peer sockfd inside the segment of its unconnected socket, laid out in
+// this process on first use; NULL once the peer is gone or expired (caller holds the
+// socket lock)
+static SOCKET_BUFFERS *peer_buffers(int sockfd) {
+    int parent = PARENT_SOCKET(sockfd), peer_idx = PEER_INDEX(sockfd);
+    SOCKET_BUFFERS *bufs = socket_buffers(parent);
+    if (bufs == NULL || bufs->peers == NULL || peer_idx >= shared_mem[parent].sock_info.peers ||
+        bufs->peer_states[peer_idx].sock_info.free) {
+        return NULL;
+    }
+    
+    SOCKET_BUFFERS *peer_bufs = &bufs->peers[peer_idx];
+    if (peer_bufs->base == NULL) {
+        int send_size = shared_mem[parent].send_info.size, recv_size = shared_mem[parent].recv_info.size;
+        peer_bufs->base = bufs->peer_area + peer_idx * peer_buffers_size(send_size, recv_size);
+        peer_bufs->shmid = bufs->shmid;
+        layout_socket_buffers(peer_bufs, peer_bufs->base, peer_buffer_size(send_size), peer_buffer_size(recv_size));
+    }
+    return peer_bufs;
+}
+
+// Entry of the peer sockfd inside the segment of its unconnected socket. Once the peer
+// is gone this is an entry of its own marked free, which callers check for like that
+// of a closed socket (caller holds the socket lock)
+SHARED_MEMORY *peer_state(int sockfd) {
+    static SHARED_MEMORY gone;
+    int parent = PARENT_SOCKET(sockfd), peer_idx = PEER_INDEX(sockfd);
+    SOCKET_BUFFERS *bufs = socket_buffers(parent);
+    if (bufs == NULL || bufs->peer_states == NULL || peer_idx >= shared_mem[parent].sock_info.peers) {
+        gone.sock_info.free = 1;
+        gone.sock_info.udp_sockid = -1;
+        return &gone;
+    }
+    return &bufs->peer_states[peer_idx];
+}
+
+// Get the buffers of a socket in this process, attaching its segment on first use.
+// Returns NULL if the socket has no buffers yet (caller holds the socket lock)
+SOCKET_BUFFERS *socket_buffers(int sockfd) {
+    if (IS_PEER(sockfd)) {
+        return peer_buffers(sockfd);
+    }
+    SOCKET_BUFFERS *bufs = &attached_buffers[sockfd];
+    int shmid = socket_state(sockfd)->sock_info.buf_shmid;
+    
+    if (bufs->base != NULL && bufs->shmid == shmid && !socket_state(sockfd)->sock_info.free) {
+        return bufs;
+    }
+    
+    // The slot was closed or reused since we last looked, drop the old mapping
+    release_socket_buffers(sockfd);
+    if (socket_state(sockfd)->sock_info.free || shmid < 0) {
+        return NULL;
+    }
+    
+    void *base = shmat(shmid, NULL, 0);
+    if (base == (void *)-1) {
+        perror("Failed to attach socket buffers");
+        return NULL;
+    }
+    int send_size = shared_mem[sockfd].send_info.size, recv_size = shared_mem[sockfd].recv_info.size;
+    size_t offset = layout_socket_buffers(bufs, base, send_size, recv_size);
+    if (shared_mem[sockfd].sock_info.unconnected) {
+        bufs->peers = calloc(MAX_PEERS, sizeof(SOCKET_BUFFERS));
+        if (bufs->peers == NULL) {
+            shmdt(base);
+            return NULL;
+        }
+        layout_peers(bufs, base, offset, send_size, recv_size);
+    }
+    bufs->base = base;
+    bufs->shmid = shmid;
+    return bufs;
+}
+
+// Round a buffer size up to a power of two, or return -1 if it is out of range
+static int round_buffer_size(int size) {
+    if (size < 1 || size > MAX_BUFFER_SIZE) {
+        return -1;
+    }
+    int rounded = 1;
+    while (rounded < size) {
+        rounded <<= 1;
+    }
+    return rounded;
+}
+
+// Find a free socket slot in the shared memory (caller holds semid_alloc)
 static int find_free_socket_slot(void) {
     for (int slot_idx = 0; slot_idx < N; slot_idx++) {
         if (shared_mem[slot_idx].sock_info.free == 1) {
@@ -80,7 +410,7 @@ static int find_free_socket_slot(void) {
     return -1;  // No free slots available
 }
 
-// Find the socket associated with the current process
+// Find the socket associated with the current process (caller holds semid_alloc)
 static int find_process_socket(void) {
     pid_t current_pid = getpid();
     
@@ -92,87 +422,361 @@ static int find_process_socket(void) {
     return -1;  // No socket found for this process
 }
 
+// No impairment at all, with the default seed
+void impairment_defaults(struct ktp_impairment *impairment) {
+    memset(impairment, 0, sizeof(*impairment));
+    impairment->seed = IMPAIR_SEED;
+}
+
+// Restart a socket's impairment state from its seed, mixed with the socket index
+// (splitmix64) so that both ends of a connection do not lose the same packets
+void reset_impairment(int sockfd) {
+    struct impair_state *state = &socket_state(sockfd)->impair_state;
+    uint64_t mixed = socket_state(sockfd)->impair.seed + (uint64_t)(sockfd + 1) * 0x9e3779b97f4a7c15ULL;
+    mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+    mixed ^= mixed >> 31;
+    state->random = (mixed != 0) ? mixed : 1;
+    state->bad = 0;
+    state->link_free = 0;
+}
+
 // Initialize the sending and receiving windows for a new socket
-static void initialize_windows(int socket_idx) {
-    // Initialize each element of the windows
-    for (int seq_idx = 0; seq_idx < MAX_SEQ_NUM; seq_idx++) {
-        // Initialize sending window slots to empty
-        shared_mem[socket_idx].swnd.slots[seq_idx] = -1;
-        shared_mem[socket_idx].send_info.timestamps[seq_idx] = -1;
-        
-        // Initialize receiving window
-        if (seq_idx < BUFFER_SIZE) {
-            // Map sequence numbers to buffer slots
-            shared_mem[socket_idx].rwnd.slots[seq_idx] = seq_idx;
-        } else {
-            // Mark other slots as unused
-            shared_mem[socket_idx].rwnd.slots[seq_idx] = -1;
-        }
+static void initialize_windows(int socket_idx, SOCKET_BUFFERS *bufs) {
+    int send_size = socket_state(socket_idx)->send_info.size;
+    int recv_size = socket_state(socket_idx)->recv_info.size;
+    
+    // Mark every send slot as not yet transmitted
+    for (int slot_idx = 0; slot_idx < send_size; slot_idx++) {
+        bufs->send_timestamps[slot_idx] = -1;
+    }
+    
+    // Mark all receive buffer slots as empty
+    for (int buf_idx = 0; buf_idx < recv_size; buf_idx++) {
+        bufs->recv_active[buf_idx] = 0;
     }
     
     // Set initial window parameters
-    shared_mem[socket_idx].swnd.size = BUFFER_SIZE;  // Start with full sending capacity
-    shared_mem[socket_idx].rwnd.size = BUFFER_SIZE;  // Start with full receiving capacity
-    shared_mem[socket_idx].swnd.start = 0;           // Start at sequence 0
-    shared_mem[socket_idx].rwnd.start = 0;           // Expect sequence 0 first
+    socket_state(socket_idx)->swnd.size = send_size;  // Start with full sending capacity
+    socket_state(socket_idx)->rwnd.size = recv_size;  // Start with full receiving capacity
+    socket_state(socket_idx)->swnd.start = 0;         // Start at sequence 0
+    socket_state(socket_idx)->rwnd.start = 0;         // Expect sequence 0 first
     
     // Initialize buffer management
-    shared_mem[socket_idx].send_info.free_slots = BUFFER_SIZE;  // All send slots available
-    shared_mem[socket_idx].recv_info.base_idx = 0;            // Start receiving at slot 0
-    shared_mem[socket_idx].buffer_full = 0;                  // Buffer has space initially
+    socket_state(socket_idx)->send_info.free_slots = send_size;  // All send slots available
+    socket_state(socket_idx)->send_info.next_seq = socket_state(socket_idx)->swnd.start;
+    socket_state(socket_idx)->send_info.reserved = 0;
+    socket_state(socket_idx)->recv_info.peeked = 0;
+    socket_state(socket_idx)->send_info.fill = 0;           // No partial stream segment
+    socket_state(socket_idx)->send_info.nodelay = 0;
+    socket_state(socket_idx)->recv_info.offset = 0;
+    socket_state(socket_idx)->recv_info.discard = 0;
+    socket_state(socket_idx)->recv_info.next_peer = 0;
+    socket_state(socket_idx)->recv_info.base_idx = socket_state(socket_idx)->rwnd.start & (recv_size - 1);
+    socket_state(socket_idx)->buffer_full = 0;                  // Buffer has space initially
+    socket_state(socket_idx)->rtt.srtt = 0;                     // No RTT sample yet
+    socket_state(socket_idx)->rtt.rttvar = 0;
+    socket_state(socket_idx)->rtt.rto = INITIAL_RTO_NS;         // Until then, time out after 1 s
+    socket_state(socket_idx)->rtt.timer_due = 0;
+    socket_state(socket_idx)->tx_pending = 0;                   // Nothing queued for S() yet
+    socket_state(socket_idx)->recv_timeout = 0;                 // Block without a time limit
+    socket_state(socket_idx)->send_timeout = 0;
+    socket_state(socket_idx)->recv_waiters = 0;
+    socket_state(socket_idx)->send_waiters = 0;
+    socket_state(socket_idx)->loss.rexmit_pending = 0;
+    socket_state(socket_idx)->loss.recovery_start = 0;
+    socket_state(socket_idx)->loss.tlp_sent = 0;
+    socket_state(socket_idx)->loss.tlp_high = socket_state(socket_idx)->swnd.start;
+    socket_state(socket_idx)->loss.tlp_at = 0;
+    socket_state(socket_idx)->loss.sacked_high = socket_state(socket_idx)->swnd.start;
+    socket_state(socket_idx)->loss.timeout_high = socket_state(socket_idx)->swnd.start;
+    socket_state(socket_idx)->loss.timeout_at = 0;
+    socket_state(socket_idx)->loss.fast_retransmits = 0;
+    socket_state(socket_idx)->loss.tail_probes = 0;
+    socket_state(socket_idx)->ack.high_seq = socket_state(socket_idx)->rwnd.start;
+    socket_state(socket_idx)->ack.delay = ACK_DELAY_NS;         // Delayed ACKs on by default
+    socket_state(socket_idx)->ack.unacked = 0;
+    socket_state(socket_idx)->ack.due = 0;
+    socket_state(socket_idx)->ack.data_received = 0;
+    socket_state(socket_idx)->ack.acks_sent = 0;
+    socket_state(socket_idx)->ack.reported = 0;
+    socket_state(socket_idx)->cc.high_seq = socket_state(socket_idx)->swnd.start;  // Nothing sent yet
+    cc_init(&socket_state(socket_idx)->cc, DEFAULT_CC);
+    socket_state(socket_idx)->impair = request_queue->impairment;  // initksocket -I
+    reset_impairment(socket_idx);
     
-    // Mark all receive buffer slots as empty
-    for (int buf_idx = 0; buf_idx < BUFFER_SIZE; buf_idx++) {
-        shared_mem[socket_idx].recv_info.active[buf_idx] = 0;
+    // Counters start over for every socket created in the slot; seq keeps counting.
+    // A peer counts in the counters of its unconnected socket
+    if (IS_PEER(socket_idx)) {
+        return;
     }
+    struct ktp_stats *stats = SOCKET_STATS(socket_idx);
+    stats_write_begin(socket_idx);
+    uint32_t seq = stats->seq;
+    memset(stats, 0, sizeof(*stats));
+    stats->seq = seq;
+    stats->rto = socket_state(socket_idx)->rtt.rto;
+    stats->cwnd = socket_state(socket_idx)->cc.cwnd;
+    stats_write_end(socket_idx);
 }
 
-// Find an available buffer slot for sending data
-static int find_free_buffer_slot(int sockfd) {
-    for (int buf_idx = 0; buf_idx < BUFFER_SIZE; buf_idx++) {
-        int slot_occupied = 0;
-        // Check if this buffer slot is already assigned to any sequence number
-        for (int seq_idx = 0; seq_idx < MAX_SEQ_NUM; seq_idx++) {
-            if (shared_mem[sockfd].swnd.slots[seq_idx] == buf_idx) {
-                slot_occupied = 1;
-                break;
-            }
+// Check if destination matches the bound address
+static int check_destination_match(int sockfd, const char* dest_ip, uint16_t dest_port) {
+    return (strcmp(socket_state(sockfd)->sock_info.ip_addr, dest_ip) == 0 && 
+            socket_state(sockfd)->sock_info.port == dest_port);
+}
+
+// First bucket of an address in a peer table
+static int peer_bucket(const struct sockaddr_in *addr) {
+    uint32_t key = ntohl(addr->sin_addr.s_addr) * 2654435761u ^ ntohs(addr->sin_port);
+    return (key ^ (key >> 16)) & (PEER_TABLE_SIZE - 1);
+}
+
+// Peer serving the remote address addr of the unconnected socket sockfd, -1 if there is
+// none. Buckets are probed linearly up to the first empty one; remove_peer_bucket()
+// keeps every entry reachable that way (caller holds the lock of sockfd)
+int find_peer(int sockfd, const struct sockaddr_in *addr) {
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    char ip_addr[INET_ADDRSTRLEN];
+    if (bufs == NULL || bufs->peer_table == NULL ||
+        inet_ntop(AF_INET, &addr->sin_addr, ip_addr, INET_ADDRSTRLEN) == NULL) {
+        return -1;
+    }
+    uint16_t port = ntohs(addr->sin_port);
+    int bucket = peer_bucket(addr);
+    for (int probe = 0; probe < PEER_TABLE_SIZE; probe++) {
+        int peer_idx = bufs->peer_table[(bucket + probe) & (PEER_TABLE_SIZE - 1)];
+        if (peer_idx < 0) {
+            return -1;  // End of the probe sequence
         }
-        // Return the first unoccupied slot
-        if (!slot_occupied) {
-            return buf_idx;
+        if (check_destination_match(PEER_SOCKET(sockfd, peer_idx), ip_addr, port)) {
+            return PEER_SOCKET(sockfd, peer_idx);
         }
     }
-    return -1;  // No free slots available
+    return -1;
 }
 
-// Check if destination matches the bound address
-static int check_destination_match(int sockfd, const char* dest_ip, uint16_t dest_port) {
-    return (strcmp(shared_mem[sockfd].sock_info.ip_addr, dest_ip) == 0 && 
-            shared_mem[sockfd].sock_info.port == dest_port);
+// Set up a free peer entry of the unconnected socket sockfd to serve addr, that of an
+// expired peer if there is one, with buffers of up to PEER_BUFFER_SIZE messages and the
+// socket's timeouts, ACK delay and congestion control, and enter it in the peer table
+// (caller holds the lock of sockfd)
+static int add_peer(int sockfd, SOCKET_BUFFERS *bufs, const struct sockaddr_in *addr) {
+    int peer;
+    if (shared_mem[sockfd].sock_info.free_peers > 0) {
+        peer = PEER_SOCKET(sockfd, bufs->peer_free[--shared_mem[sockfd].sock_info.free_peers]);
+    } else {
+        peer = PEER_SOCKET(sockfd, shared_mem[sockfd].sock_info.peers);
+        shared_mem[sockfd].sock_info.peers++;
+    }
+    
+    struct sock_info *info = &socket_state(peer)->sock_info;
+    *info = shared_mem[sockfd].sock_info;  // Same owner, UDP socket and worker
+    info->unconnected = 0;
+    info->peers = 0;
+    info->free_peers = 0;
+    inet_ntop(AF_INET, &addr->sin_addr, info->ip_addr, INET_ADDRSTRLEN);
+    info->port = ntohs(addr->sin_port);
+    socket_state(peer)->send_info.size = peer_buffer_size(shared_mem[sockfd].send_info.size);
+    socket_state(peer)->recv_info.size = peer_buffer_size(shared_mem[sockfd].recv_info.size);
+    initialize_windows(peer, socket_buffers(peer));
+    socket_state(peer)->recv_timeout = shared_mem[sockfd].recv_timeout;
+    socket_state(peer)->send_timeout = shared_mem[sockfd].send_timeout;
+    socket_state(peer)->ack.delay = shared_mem[sockfd].ack.delay;
+    cc_init(&socket_state(peer)->cc, shared_mem[sockfd].cc.algorithm);
+    socket_state(peer)->last_active = monotonic_ns();
+    
+    // Take the first empty bucket of the probe sequence
+    int bucket = peer_bucket(addr);
+    while (bufs->peer_table[bucket] >= 0) {
+        bucket = (bucket + 1) & (PEER_TABLE_SIZE - 1);
+    }
+    bufs->peer_table[bucket] = PEER_INDEX(peer);
+    return peer;
+}
+
+/* Peer serving the remote address addr of the unconnected socket sockfd. A peer gets an
+ * entry, windows and buffers of its own inside the socket's buffer segment on the first
+ * message sent to or received from it, and keeps them until sockfd is closed or the
+ * peer expires; no IPC object is created for it. Returns -1 with errno set if sockfd is
+ * not unconnected or already has MAX_PEERS peers (caller holds the lock of sockfd) */
+int open_peer(int sockfd, const struct sockaddr_in *addr) {
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL || bufs->peer_table == NULL || shared_mem[sockfd].sock_info.free) {
+        errno = EINVAL;
+        return -1;
+    }
+    int peer = find_peer(sockfd, addr);
+    if (peer >= 0) {
+        return peer;
+    }
+    if (shared_mem[sockfd].sock_info.peers >= MAX_PEERS && shared_mem[sockfd].sock_info.free_peers == 0) {
+        errno = ENOSPACE;
+        return -1;
+    }
+    return add_peer(sockfd, bufs, addr);
+}
+
+// Free every peer of the unconnected socket sockfd and empty its peer table. Threads
+// blocked in k_sendto to a peer are woken here, as the peers cannot be found once the
+// lock is released, and return EINVAL (caller holds the lock of sockfd)
+void release_peers(int sockfd) {
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL || bufs->peer_table == NULL) {
+        return;
+    }
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        SHARED_MEMORY *peer = &bufs->peer_states[peer_idx];
+        peer->sock_info.free = 1;
+        peer->sock_info.udp_sockid = -1;
+        peer->send_event++;
+        if (peer->send_waiters > 0) {
+            wake_socket_event(&peer->send_event);
+        }
+    }
+    for (int bucket = 0; bucket < PEER_TABLE_SIZE; bucket++) {
+        bufs->peer_table[bucket] = -1;
+    }
+    shared_mem[sockfd].sock_info.peers = 0;
+    shared_mem[sockfd].sock_info.free_peers = 0;
+}
+
+// First bucket of the peer at peer_idx of the unconnected socket sockfd in its peer table
+static int peer_home_bucket(int sockfd, int peer_idx) {
+    const struct sock_info *info = &socket_state(PEER_SOCKET(sockfd, peer_idx))->sock_info;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_port = htons(info->port);
+    inet_pton(AF_INET, info->ip_addr, &addr.sin_addr);
+    return peer_bucket(&addr);
+}
+
+/* Empty the bucket of the peer at peer_idx in the peer table of sockfd without leaving a
+ * hole in any probe sequence: each later entry of the run moves back into the emptied
+ * bucket unless its own first bucket lies after it, and that entry's bucket is emptied
+ * in turn (backward-shift deletion), so find_peer() can still stop at the first empty
+ * bucket (caller holds the lock of sockfd) */
+static void remove_peer_bucket(int sockfd, SOCKET_BUFFERS *bufs, int peer_idx) {
+    int mask = PEER_TABLE_SIZE - 1, hole = peer_home_bucket(sockfd, peer_idx);
+    for (int probe = 0; bufs->peer_table[hole] != peer_idx; probe++) {
+        if (probe == PEER_TABLE_SIZE || bufs->peer_table[hole] < 0) {
+            return;  // Not in the table
+        }
+        hole = (hole + 1) & mask;
+    }
+    
+    for (int next = (hole + 1) & mask; bufs->peer_table[next] >= 0; next = (next + 1) & mask) {
+        // The entry may move back unless the hole is before its first bucket
+        int home = peer_home_bucket(sockfd, bufs->peer_table[next]);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            bufs->peer_table[hole] = bufs->peer_table[next];
+            hole = next;
+        }
+    }
+    bufs->peer_table[hole] = -1;
+}
+
+// Whether the peer sockfd has nothing queued, in flight, unread or left to acknowledge,
+// and no k_sendto waits on it (caller holds the socket lock)
+static int peer_drained(int sockfd) {
+    SHARED_MEMORY *state = socket_state(sockfd);
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL || state->send_info.free_slots < state->send_info.size ||
+        state->ack.due != 0 || state->send_waiters > 0) {
+        return 0;
+    }
+    for (int slot_idx = 0; slot_idx < state->recv_info.size; slot_idx++) {
+        if (bufs->recv_active[slot_idx]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Expire the peers of the unconnected socket sockfd that are drained and have not been
+ * heard from for PEER_IDLE_TIMEOUT seconds at now (CLOCK_MONOTONIC ns): their buckets
+ * are emptied and their entries go on peer_free for the next peers opened. Nobody waits
+ * on a drained peer, so there is nobody to wake. A remote that speaks again later gets
+ * a new peer, which starts over at sequence number 0. Returns the number of peers
+ * expired (caller holds the lock of sockfd) */
+int expire_peers(int sockfd, int64_t now) {
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL || bufs->peer_table == NULL || !shared_mem[sockfd].sock_info.unconnected) {
+        return 0;
+    }
+    int64_t idle_since = now - PEER_IDLE_TIMEOUT * NSEC_PER_SEC;
+    int expired = 0;
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        int peer = PEER_SOCKET(sockfd, peer_idx);
+        if (socket_state(peer)->sock_info.free || socket_state(peer)->last_active > idle_since ||
+            !peer_drained(peer)) {
+            continue;
+        }
+        remove_peer_bucket(sockfd, bufs, peer_idx);
+        socket_state(peer)->sock_info.free = 1;
+        socket_state(peer)->sock_info.udp_sockid = -1;
+        bufs->peer_free[shared_mem[sockfd].sock_info.free_peers++] = peer_idx;
+        expired++;
+    }
+    return expired;
+}
+
+// Give the messages queued to each peer of the unconnected socket sockfd until
+// linger_end (CLOCK_MONOTONIC ns) to be acknowledged
+static void linger_peers(int sockfd, int64_t linger_end) {
+    lock_socket(sockfd);
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        int peer = PEER_SOCKET(sockfd, peer_idx);
+        while (!socket_state(peer)->sock_info.free &&
+               socket_state(peer)->send_info.free_slots < socket_state(peer)->send_info.size) {
+            if (wait_socket_event(peer, &socket_state(peer)->send_event,
+                                  &socket_state(peer)->send_waiters, linger_end) < 0) {
+                break;
+            }
+        }
+    }
+    unlock_socket(sockfd);
 }
 
-// Create a new KTP socket
+// Create a new KTP socket with the default buffer sizes
 int k_socket(int domain, int type, int protocol) {
+    return k_socket_sized(domain, type, protocol, DEFAULT_BUFFER_SIZE, DEFAULT_BUFFER_SIZE);
+}
+
+// Create a new KTP socket whose send and receive buffers hold the given number of
+// messages (rounded up to a power of two, at most MAX_BUFFER_SIZE)
+int k_socket_sized(int domain, int type, int protocol, int send_size, int recv_size) {
     // Connect to IPC resources
     retrieve_SHARED_MEMORY();
-    init_sembuf();
     
     // Validate socket parameters
-    if (domain != AF_INET || type != SOCK_KTP) {
+    send_size = round_buffer_size(send_size);
+    recv_size = round_buffer_size(recv_size);
+    if (domain != AF_INET || (type != SOCK_KTP && type != SOCK_KTP_STREAM) ||
+        send_size < 0 || recv_size < 0) {
         errno = EINVAL;
         return -1;
     }
     
     // Atomic operation to find and allocate a free socket slot
-    P(semid_shared_mem);
+    P(semid_alloc);
     int socket_idx = find_free_socket_slot();
-    // If we found a slot, mark it as used
+    // If we found a slot, mark it as used; its buffers are set up once they exist
     if (socket_idx >= 0) {
+        lock_socket(socket_idx);
         shared_mem[socket_idx].sock_info.free = 0;
         shared_mem[socket_idx].sock_info.pid = getpid();
+        shared_mem[socket_idx].sock_info.udp_sockid = -1;
+        shared_mem[socket_idx].sock_info.buf_shmid = -1;
+        shared_mem[socket_idx].sock_info.stream = (type == SOCK_KTP_STREAM);
+        shared_mem[socket_idx].sock_info.worker = 0;  // Chosen by initksocket at creation
+        shared_mem[socket_idx].sock_info.unconnected = 0;
+        shared_mem[socket_idx].sock_info.peers = 0;
+        shared_mem[socket_idx].sock_info.free_peers = 0;
+        shared_mem[socket_idx].sock_info.ip_addr[0] = '\0';
+        shared_mem[socket_idx].sock_info.port = 0;
+        unlock_socket(socket_idx);
     }
-    V(semid_shared_mem);
+    V(semid_alloc);
     
     // Handle no available slots
     if (socket_idx < 0) {
@@ -180,275 +784,1294 @@ int k_socket(int domain, int type, int protocol) {
         return -1;
     }
     
-    // Request UDP socket creation from initksocket
-    P(semid_net_socket);
-    memset(net_socket, 0, sizeof(NET_SOCKET));  // Clear any previous data
-    V(semid_net_socket);
-    
-    // Signal init process and wait for response
-    V(semid_init);
-    P(semid_ktp);
-    
-    // Check UDP socket creation status
-    P(semid_net_socket);
-    if (net_socket->sock_id < 0) {
+    // Request UDP socket and buffer creation from initksocket
+    NET_SOCKET request;
+    memset(&request, 0, sizeof(request));
+    request.type = CREATE_REQUEST;
+    request.send_size = send_size;
+    request.recv_size = recv_size;
+    if (submit_request(socket_idx, &request) < 0) {
         // Socket creation failed, mark KTP socket as free again
-        errno = net_socket->err_code;
-        P(semid_shared_mem);
+        int saved_errno = errno;
+        P(semid_alloc);
+        lock_socket(socket_idx);
         shared_mem[socket_idx].sock_info.free = 1;
-        V(semid_shared_mem);
-        V(semid_net_socket);
+        unlock_socket(socket_idx);
+        V(semid_alloc);
+        errno = saved_errno;
         return -1;
     }
     
-    // Associate UDP socket with KTP socket
-    shared_mem[socket_idx].sock_info.udp_sockid = net_socket->sock_id;
-    memset(net_socket, 0, sizeof(NET_SOCKET));
-    V(semid_net_socket);
-    
-    // Initialize windows and buffers
-    P(semid_shared_mem);
-    initialize_windows(socket_idx);
-    V(semid_shared_mem);
+    // Associate UDP socket and buffers with KTP socket
+    lock_socket(socket_idx);
+    shared_mem[socket_idx].sock_info.udp_sockid = request.sock_id;
+    shared_mem[socket_idx].sock_info.buf_shmid = request.buf_shmid;
+    shared_mem[socket_idx].send_info.size = send_size;
+    shared_mem[socket_idx].recv_info.size = recv_size;
+    SOCKET_BUFFERS *bufs = socket_buffers(socket_idx);
+    if (bufs != NULL) {
+        initialize_windows(socket_idx, bufs);
+    }
+    unlock_socket(socket_idx);
     
+    if (bufs == NULL) {
+        k_close(socket_idx);
+        errno = ENOMEM;
+        return -1;
+    }
     return socket_idx;
 }
 
-// Bind a KTP socket to source and destination addresses
+// Bind a KTP socket to source and destination addresses. Without a destination (dest_ip
+// NULL, or 0.0.0.0 with port 0) the socket is unconnected: k_sendto takes any peer and
+// k_recvfrom returns messages from all of them with their sender
 int k_bind(char src_ip[], uint16_t src_port, char dest_ip[], uint16_t dest_port) {
     retrieve_SHARED_MEMORY();
-    init_sembuf();
     
     // Find the socket for this process
-    P(semid_shared_mem);
+    P(semid_alloc);
     int socket_idx = find_process_socket();
+    V(semid_alloc);
     if (socket_idx < 0) {
-        V(semid_shared_mem);
         errno = EINVAL;
         return -1;
     }
-    V(semid_shared_mem);
     
-    // Set up bind request for initksocket
-    P(semid_net_socket);
-    net_socket->sock_id = shared_mem[socket_idx].sock_info.udp_sockid;
-    strncpy(net_socket->ip_addr, src_ip, INET_ADDRSTRLEN);
-    net_socket->ip_addr[INET_ADDRSTRLEN-1] = '\0';
-    net_socket->port = src_port;
-    V(semid_net_socket);
-    
-    // Signal init process and wait for response
-    V(semid_init);
-    P(semid_ktp);
+    lock_socket(socket_idx);
+    int udp_sockid = shared_mem[socket_idx].sock_info.udp_sockid;
+    unlock_socket(socket_idx);
     
-    // Check bind status
-    P(semid_net_socket);
-    if (net_socket->sock_id < 0) {
-        // Bind failed
-        errno = net_socket->err_code;
-        memset(net_socket, 0, sizeof(NET_SOCKET));
-        V(semid_net_socket);
-        return -1;
+    // Set up bind request for initksocket; an unconnected socket also gets a buffer
+    // segment with room for its peers
+    int unconnected = (dest_ip == NULL || (strcmp(dest_ip, "0.0.0.0") == 0 && dest_port == 0));
+    NET_SOCKET request;
+    memset(&request, 0, sizeof(request));
+    request.type = BIND_REQUEST;
+    request.sock_id = udp_sockid;
+    strncpy(request.ip_addr, src_ip, INET_ADDRSTRLEN);
+    request.ip_addr[INET_ADDRSTRLEN-1] = '\0';
+    request.port = src_port;
+    request.unconnected = unconnected;
+    request.buf_shmid = -1;
+    if (submit_request(socket_idx, &request) < 0) {
+        return -1;  // Bind failed
     }
-    memset(net_socket, 0, sizeof(NET_SOCKET));
-    V(semid_net_socket);
     
     // Store destination address for future checks
-    P(semid_shared_mem);
-    strncpy(shared_mem[socket_idx].sock_info.ip_addr, dest_ip, INET_ADDRSTRLEN);
+    int old_shmid = -1, attached = 1;
+    lock_socket(socket_idx);
+    if (unconnected) {
+        old_shmid = shared_mem[socket_idx].sock_info.buf_shmid;
+        shared_mem[socket_idx].sock_info.buf_shmid = request.buf_shmid;
+        shared_mem[socket_idx].sock_info.peers = 0;
+        shared_mem[socket_idx].sock_info.free_peers = 0;
+    }
+    shared_mem[socket_idx].sock_info.unconnected = unconnected;
+    strncpy(shared_mem[socket_idx].sock_info.ip_addr, unconnected ? "" : dest_ip, INET_ADDRSTRLEN);
     shared_mem[socket_idx].sock_info.ip_addr[INET_ADDRSTRLEN-1] = '\0';
-    shared_mem[socket_idx].sock_info.port = dest_port;
-    V(semid_shared_mem);
+    shared_mem[socket_idx].sock_info.port = unconnected ? 0 : dest_port;
+    if (unconnected) {
+        // No peers until it is talked to; its own buffers stay unused
+        SOCKET_BUFFERS *bufs = socket_buffers(socket_idx);
+        attached = (bufs != NULL);
+        for (int bucket = 0; attached && bucket < PEER_TABLE_SIZE; bucket++) {
+            bufs->peer_table[bucket] = -1;
+        }
+    }
+    unlock_socket(socket_idx);
     
+    // The segment the socket was created with is freed once initksocket detaches too
+    if (old_shmid >= 0) {
+        shmctl(old_shmid, IPC_RMID, NULL);
+    }
+    if (!attached) {
+        errno = ENOMEM;
+        return -1;
+    }
     return 0;
 }
 
-// Send data through a KTP socket
-ssize_t k_sendto(int sockfd, const void *buf, size_t len, int flags, 
-                const struct sockaddr *dest_addr, socklen_t addrlen) {
-    retrieve_SHARED_MEMORY();
-    init_sembuf();
-    
-    // Basic validation
-    if (sockfd < 0 || sockfd >= N) {
+// Check that a socket is allocated and of the given kind, 1 for SOCK_KTP_STREAM and
+// 0 for SOCK_KTP, with a destination of its own; returns -1 with errno set otherwise
+// (caller holds the socket lock)
+static int check_socket_mode(int sockfd, int stream) {
+    if (socket_state(sockfd)->sock_info.free) {
         errno = EINVAL;
         return -1;
     }
-    
-    P(semid_shared_mem);
-    // Check if socket is allocated
-    if (shared_mem[sockfd].sock_info.free) {
-        V(semid_shared_mem);
-        errno = EINVAL;
+    if (socket_state(sockfd)->sock_info.stream != stream || socket_state(sockfd)->sock_info.unconnected) {
+        errno = EOPNOTSUPP;
         return -1;
     }
-    V(semid_shared_mem);
-    
-    // Extract destination address
-    char dest_ip[INET_ADDRSTRLEN];
-    const struct sockaddr_in *addr_in = (const struct sockaddr_in *)dest_addr;
-    if (inet_ntop(AF_INET, &(addr_in->sin_addr), dest_ip, INET_ADDRSTRLEN) == NULL) {
-        errno = EINVAL;
-        return -1;
+    return 0;
+}
+
+// Number of fragments, and so of send slots and sequence numbers, a message takes
+static int fragment_count(size_t len) {
+    return (len <= MAX_MSG_SIZE) ? 1 : (len + MAX_MSG_SIZE - 1) / MAX_MSG_SIZE;
+}
+
+// Wait for the send slots from next_seq on to have room for a message of count
+// fragments and to be available to this caller. Returns the buffers, or NULL with
+// errno set (caller holds the socket lock)
+static SOCKET_BUFFERS *wait_send_slot(int sockfd, int flags, int count) {
+    // A message reserved with k_send_reserve owns the slot until it is committed
+    if (socket_state(sockfd)->send_info.reserved) {
+        errno = EBUSY;
+        return NULL;
     }
-    uint16_t dest_port = ntohs(addr_in->sin_port);
-    
-    P(semid_shared_mem);
     
-    // Verify destination matches bound address
-    if (!check_destination_match(sockfd, dest_ip, dest_port)) {
-        V(semid_shared_mem);
-        errno = ENOTBOUND;
-        return -1;
+    // Wait for buffer space unless the caller asked not to block
+    int64_t deadline = socket_state(sockfd)->send_timeout;
+    deadline = (deadline > 0) ? monotonic_ns() + deadline : 0;
+    while (socket_state(sockfd)->send_info.free_slots < count) {
+        if ((flags & MSG_DONTWAIT) ||
+            wait_socket_event(sockfd, &socket_state(sockfd)->send_event,
+                              &socket_state(sockfd)->send_waiters, deadline) < 0) {
+            stats_write_begin(sockfd);
+            SOCKET_STATS(sockfd)->enospace++;
+            stats_write_end(sockfd);
+            errno = ENOSPACE;
+            return NULL;
+        }
+        
+        // k_close or k_send_reserve may have been called from another thread meanwhile
+        if (socket_state(sockfd)->sock_info.free) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (socket_state(sockfd)->send_info.reserved) {
+            errno = EBUSY;
+            return NULL;
+        }
     }
     
-    // Check for buffer space
-    if (shared_mem[sockfd].send_info.free_slots <= 0) {
-        V(semid_shared_mem);
-        errno = ENOSPACE;
-        return -1;
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL) {
+        errno = EINVAL;
     }
+    return bufs;
+}
+
+// Hand the fragment written to the slot of next_seq over to S(); returns 1 if the
+// doorbell must be rung once the socket lock is released
+static int queue_send_slot(int sockfd, SOCKET_BUFFERS *bufs, size_t len, int frag_flags) {
+    // Next sequence number and the slot it maps to
+    uint32_t seq_num = socket_state(sockfd)->send_info.next_seq++;
+    int slot_idx = seq_num & (socket_state(sockfd)->send_info.size - 1);
     
-    // Find next available sequence number
-    int seq_num = shared_mem[sockfd].swnd.start;
-    int seq_checked_count = 0;
-    while (shared_mem[sockfd].swnd.slots[seq_num] != -1) {
-        seq_num = (seq_num + 1) % MAX_SEQ_NUM;
-        seq_checked_count++;
+    bufs->send_lengths[slot_idx] = len;
+    bufs->send_flags[slot_idx] = frag_flags;
+    bufs->send_timestamps[slot_idx] = -1;  // Not sent yet
+    bufs->send_sacked[slot_idx] = 0;
+    bufs->send_retries[slot_idx] = 0;
+    socket_state(sockfd)->send_info.free_slots--;
+    return mark_tx_pending(sockfd);
+}
+
+// Queue the partial segment k_write has built in the slot of next_seq; returns 1 if
+// the doorbell must be rung once the socket lock is released (caller holds it)
+int flush_stream_segment(int sockfd, SOCKET_BUFFERS *bufs) {
+    int len = socket_state(sockfd)->send_info.fill;
+    socket_state(sockfd)->send_info.fill = 0;
+    return queue_send_slot(sockfd, bufs, len, 0);
+}
+
+// Check a message before it is queued: its destination, if given, must be the bound
+// one, and its iovecs must add up to at most MAX_MESSAGE_SIZE bytes in no more
+// fragments than the send buffer holds. Returns the message length, or -1 with errno
+// set (caller holds the socket lock)
+static ssize_t check_send_message(int sockfd, const struct msghdr *msg) {
+    if (msg->msg_name != NULL) {
+        // Extract destination address
+        char dest_ip[INET_ADDRSTRLEN];
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)msg->msg_name;
+        if (inet_ntop(AF_INET, &(addr_in->sin_addr), dest_ip, INET_ADDRSTRLEN) == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
         
-        // Prevent infinite loop - checked all possible slots
-        if (seq_checked_count >= MAX_SEQ_NUM) {
-            V(semid_shared_mem);
-            errno = ENOSPACE;
+        // Verify destination matches bound address
+        if (!check_destination_match(sockfd, dest_ip, ntohs(addr_in->sin_port))) {
+            errno = ENOTBOUND;
             return -1;
         }
     }
     
-    // Find available send buffer slot
-    int buffer_idx = find_free_buffer_slot(sockfd);
-    if (buffer_idx < 0) {
-        V(semid_shared_mem);
-        errno = ENOSPACE;
+    size_t len = 0;
+    for (size_t iov_idx = 0; iov_idx < msg->msg_iovlen; iov_idx++) {
+        if (msg->msg_iov[iov_idx].iov_len > MAX_MESSAGE_SIZE - len) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        len += msg->msg_iov[iov_idx].iov_len;
+    }
+    if (fragment_count(len) > socket_state(sockfd)->send_info.size) {
+        errno = EMSGSIZE;
         return -1;
     }
+    return len;
+}
+
+// Copy a message gathered from its iovecs into the send slots from next_seq on, one
+// fragment per MAX_MSG_SIZE bytes, and queue them; returns 1 if the doorbell must be
+// rung once the socket lock is released (caller holds it and made room)
+static int queue_message(int sockfd, SOCKET_BUFFERS *bufs, const struct msghdr *msg, size_t len) {
+    int fragments = fragment_count(len);
+    size_t iov_idx = 0, iov_off = 0;
+    int ring = 0;
     
-    // Store data and metadata
-    shared_mem[sockfd].swnd.slots[seq_num] = buffer_idx;
-    memcpy(shared_mem[sockfd].send_info.buffer[buffer_idx], buf, len);
-    shared_mem[sockfd].send_info.lengths[buffer_idx] = len;
-    shared_mem[sockfd].send_info.timestamps[seq_num] = -1;  // Not sent yet
-    shared_mem[sockfd].send_info.free_slots--;
+    for (int frag_idx = 0; frag_idx < fragments; frag_idx++) {
+        // Store the data behind the header space of its slot
+        int slot_idx = socket_state(sockfd)->send_info.next_seq & (socket_state(sockfd)->send_info.size - 1);
+        char *payload = bufs->send_buffer[slot_idx] + HEADER_SIZE;
+        size_t frag_len = len - (size_t)frag_idx * MAX_MSG_SIZE;
+        frag_len = (frag_len < MAX_MSG_SIZE) ? frag_len : MAX_MSG_SIZE;
+        
+        for (size_t filled = 0; filled < frag_len; ) {
+            const struct iovec *iov = &msg->msg_iov[iov_idx];
+            size_t copy_len = iov->iov_len - iov_off;
+            copy_len = (frag_len - filled < copy_len) ? frag_len - filled : copy_len;
+            memcpy(payload + filled, (const char *)iov->iov_base + iov_off, copy_len);
+            filled += copy_len;
+            iov_off += copy_len;
+            if (iov_off == iov->iov_len) {
+                iov_idx++;
+                iov_off = 0;
+            }
+        }
+        
+        int frag_flags = ((frag_idx > 0) ? FRAG_CONT : 0) | ((frag_idx < fragments - 1) ? FRAG_MORE : 0);
+        ring |= queue_send_slot(sockfd, bufs, frag_len, frag_flags);
+    }
+    return ring;
+}
+
+// Queue up to vlen messages to a connected socket or a peer, blocking until the first
+// one fits. Returns the number queued, or -1 with errno set if none was; *ring is set
+// if the doorbell must be rung once the socket lock is released (caller holds it)
+static int queue_messages(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags, int *ring) {
+    // Check if socket is allocated
+    if (check_socket_mode(sockfd, 0) < 0) {
+        return -1;
+    }
     
-    V(semid_shared_mem);
-    return len;
+    // Fail a bad first message at once instead of after waiting for space
+    SOCKET_BUFFERS *bufs;
+    ssize_t first_len = check_send_message(sockfd, &msgvec[0].msg_hdr);
+    if (first_len < 0 || (bufs = wait_send_slot(sockfd, flags, fragment_count(first_len))) == NULL) {
+        return -1;
+    }
+    
+    unsigned int queued = 0;
+    while (queued < vlen) {
+        const struct msghdr *msg = &msgvec[queued].msg_hdr;
+        ssize_t len = check_send_message(sockfd, msg);
+        if (len < 0) {
+            break;  // Reported by the next call, which starts with this message
+        }
+        if (socket_state(sockfd)->send_info.free_slots < fragment_count(len)) {
+            break;  // No room left for all of its fragments
+        }
+        *ring |= queue_message(sockfd, bufs, msg, len);
+        msgvec[queued].msg_len = len;
+        queued++;
+    }
+    return queued;
 }
 
-// Receive data from a KTP socket
-ssize_t k_recvfrom(int sockfd, void *buf, size_t len, int flags, 
-                  struct sockaddr *src_addr, socklen_t *addrlen) {
+// Queue messages of an unconnected socket to the peers they are addressed to, opening
+// a peer for each new address. Blocks for the first message only (caller holds the
+// lock of sockfd, which the peers share)
+static int send_to_peers(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags, int *ring) {
+    unsigned int queued = 0;
+    while (queued < vlen) {
+        const struct msghdr *msg = &msgvec[queued].msg_hdr;
+        if (msg->msg_name == NULL || msg->msg_namelen < sizeof(struct sockaddr_in)) {
+            errno = ENOTBOUND;
+            break;
+        }
+        int peer = open_peer(sockfd, (const struct sockaddr_in *)msg->msg_name);
+        int peer_flags = (queued > 0) ? flags | MSG_DONTWAIT : flags;
+        if (peer < 0 || queue_messages(peer, &msgvec[queued], 1, peer_flags, ring) < 1) {
+            break;
+        }
+        queued++;
+    }
+    return (queued > 0) ? (int)queued : -1;
+}
+
+// Queue up to vlen messages, each gathered from its iovecs into as many send slots as
+// it has fragments, in a single critical section. Blocks like k_sendto until the first message fits, then
+// queues as many as there is space for. Returns the number queued and stores each
+// length in msg_len; -1 with errno set if none was
+int k_sendmmsg(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags) {
     retrieve_SHARED_MEMORY();
-    init_sembuf();
     
-    P(semid_shared_mem);
+    // Basic validation
+    if (sockfd < 0 || sockfd >= N || (msgvec == NULL && vlen > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (vlen == 0) {
+        return 0;
+    }
     
-    // Validate socket
-    if (sockfd < 0 || sockfd >= N || shared_mem[sockfd].sock_info.free) {
-        V(semid_shared_mem);
+    // An unconnected socket sends through its peers
+    int ring = 0, queued;
+    lock_socket(sockfd);
+    if (!socket_state(sockfd)->sock_info.free && socket_state(sockfd)->sock_info.unconnected) {
+        queued = send_to_peers(sockfd, msgvec, vlen, flags, &ring);
+    } else {
+        queued = queue_messages(sockfd, msgvec, vlen, flags, &ring);
+    }
+    unlock_socket(sockfd);
+    
+    // Let S() send the messages now instead of on its next timer tick
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return queued;
+}
+
+// Send one message gathered from msg->msg_iov; msg->msg_name may be NULL for the
+// bound destination
+ssize_t k_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+    if (msg == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct k_mmsghdr entry;
+    entry.msg_hdr = *msg;
+    if (k_sendmmsg(sockfd, &entry, 1, flags) < 0) {
+        return -1;
+    }
+    return entry.msg_len;
+}
+
+// Send data through a KTP socket
+ssize_t k_sendto(int sockfd, const void *buf, size_t len, int flags, 
+                const struct sockaddr *dest_addr, socklen_t addrlen) {
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)dest_addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return k_sendmsg(sockfd, &msg, flags);
+}
+
+// Reserve the next send slot and return where up to MAX_MSG_SIZE bytes of the message
+// go, so that it is built in shared memory without a copy. Waits for space like
+// k_sendto; the message is sent to the bound destination by k_send_commit
+void *k_send_reserve(int sockfd, int flags) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    lock_socket(sockfd);
+    if (check_socket_mode(sockfd, 0) < 0) {
+        unlock_socket(sockfd);
+        return NULL;
+    }
+    
+    SOCKET_BUFFERS *bufs = wait_send_slot(sockfd, flags, 1);
+    if (bufs == NULL) {
+        unlock_socket(sockfd);
+        return NULL;
+    }
+    
+    // No one else touches the slot of next_seq until it is committed: k_sendto and
+    // k_send_reserve fail with EBUSY, and the daemon only reads slots below next_seq
+    int slot_idx = socket_state(sockfd)->send_info.next_seq & (socket_state(sockfd)->send_info.size - 1);
+    socket_state(sockfd)->send_info.reserved = 1;
+    char *payload = bufs->send_buffer[slot_idx] + HEADER_SIZE;
+    unlock_socket(sockfd);
+    return payload;
+}
+
+// Queue the len bytes written to the slot from k_send_reserve for sending
+int k_send_commit(int sockfd, size_t len) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > MAX_MSG_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL || !socket_state(sockfd)->send_info.reserved) {
+        unlock_socket(sockfd);
         errno = EINVAL;
         return -1;
     }
+    socket_state(sockfd)->send_info.reserved = 0;
+    int ring = queue_send_slot(sockfd, bufs, len, 0);
+    unlock_socket(sockfd);
     
-    // Check if any data is available in the receive buffer
-    int base_idx = shared_mem[sockfd].recv_info.base_idx;
-    if (shared_mem[sockfd].recv_info.active[base_idx]) {
-        // Get message length and copy appropriate amount of data
-        int data_len = shared_mem[sockfd].recv_info.lengths[base_idx];
-        int copy_len = (data_len < len) ? data_len : len;
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return 0;
+}
+
+// Free the slot at base_idx once its message has been read; returns 1 if the
+// doorbell must be rung once the socket lock is released
+static int release_recv_slot(int sockfd, SOCKET_BUFFERS *bufs) {
+    int base_idx = socket_state(sockfd)->recv_info.base_idx;
+    bufs->recv_active[base_idx] = 0;  // Mark slot as free
+    
+    // Advance base pointer to next slot
+    socket_state(sockfd)->recv_info.base_idx = (base_idx + 1) & (socket_state(sockfd)->recv_info.size - 1);
+    
+    // Update receiver window size
+    int ring = 0;
+    if (socket_state(sockfd)->rwnd.size < socket_state(sockfd)->recv_info.size) {
+        socket_state(sockfd)->rwnd.size++;
         
-        memcpy(buf, shared_mem[sockfd].recv_info.buffer[base_idx], copy_len);
-        shared_mem[sockfd].recv_info.active[base_idx] = 0;  // Mark slot as free
+        // If we transitioned from full to having space, have S() send a window update
+        if (socket_state(sockfd)->rwnd.size == 1) {
+            socket_state(sockfd)->buffer_full = 1;
+            ring = mark_tx_pending(sockfd);
+        }
+    }
+    return ring;
+}
+
+// Fragments of the message at base_idx if all of them have arrived, 0 if some are
+// still missing, -1 if it has more fragments than the receive buffer holds
+static int message_fragments(int sockfd, SOCKET_BUFFERS *bufs) {
+    int size = socket_state(sockfd)->recv_info.size;
+    int slot_idx = socket_state(sockfd)->recv_info.base_idx;
+    for (int count = 1; count <= size; count++) {
+        if (!bufs->recv_active[slot_idx]) {
+            return 0;
+        }
+        if (!(bufs->recv_flags[slot_idx] & FRAG_MORE)) {
+            return count;
+        }
+        slot_idx = (slot_idx + 1) & (size - 1);
+    }
+    return -1;
+}
+
+// Free the fragments that have arrived of a message being discarded, up to and
+// including its last one; returns 1 if the doorbell must be rung
+static int drop_discarded_fragments(int sockfd, SOCKET_BUFFERS *bufs) {
+    int ring = 0;
+    while (socket_state(sockfd)->recv_info.discard &&
+           bufs->recv_active[socket_state(sockfd)->recv_info.base_idx]) {
+        int frag_flags = bufs->recv_flags[socket_state(sockfd)->recv_info.base_idx];
+        ring |= release_recv_slot(sockfd, bufs);
+        socket_state(sockfd)->recv_info.discard = (frag_flags & FRAG_MORE) != 0;
+    }
+    return ring;
+}
+
+// Wait for the next in-order message to be complete. Returns the buffers holding it
+// from recv_info.base_idx on, or NULL with errno set. A message too big for the
+// receive buffer can never complete: it fails the call with EMSGSIZE and is dropped
+// as its fragments arrive. *ring is set if the doorbell must be rung once the socket
+// lock is released (caller holds it)
+static SOCKET_BUFFERS *wait_recv_slot(int sockfd, int flags, int *ring) {
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    // A message handed out by k_recv_peek stays at base_idx until it is released
+    if (socket_state(sockfd)->recv_info.peeked) {
+        errno = EBUSY;
+        return NULL;
+    }
+    
+    // Wait for the next in-order message unless the caller asked not to block
+    int64_t deadline = socket_state(sockfd)->recv_timeout;
+    deadline = (deadline > 0) ? monotonic_ns() + deadline : 0;
+    int fragments;
+    *ring |= drop_discarded_fragments(sockfd, bufs);
+    while ((fragments = message_fragments(sockfd, bufs)) <= 0) {
+        if (fragments < 0) {
+            socket_state(sockfd)->recv_info.discard = 1;
+            *ring |= drop_discarded_fragments(sockfd, bufs);
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        if ((flags & MSG_DONTWAIT) ||
+            wait_socket_event(sockfd, &socket_state(sockfd)->recv_event,
+                              &socket_state(sockfd)->recv_waiters, deadline) < 0) {
+            // No data available
+            stats_write_begin(sockfd);
+            SOCKET_STATS(sockfd)->enomessage++;
+            stats_write_end(sockfd);
+            errno = ENOMESSAGE;
+            return NULL;
+        }
         
-        // Update window management
-        int found_seq = -1;
+        // k_close may have been called from another thread meanwhile
+        bufs = socket_buffers(sockfd);
+        if (bufs == NULL) {
+            errno = EINVAL;
+            return NULL;
+        }
+        *ring |= drop_discarded_fragments(sockfd, bufs);
+    }
+    return bufs;
+}
+
+// Gather the fragments of the message from base_idx on into msg->msg_iov, fill in
+// msg->msg_name and free their slots. Returns the number of bytes stored; MSG_TRUNC
+// is set in msg->msg_flags if the message did not fit. Like recvfrom(2), at most
+// msg_namelen bytes of the address are stored and msg_namelen is set to its full
+// size (caller holds the socket lock and the message is complete)
+static size_t dequeue_message(int sockfd, SOCKET_BUFFERS *bufs, struct msghdr *msg, int *ring) {
+    int fragments = message_fragments(sockfd, bufs);
+    size_t copied = 0, iov_idx = 0, iov_off = 0;
+    int truncated = 0;
+    
+    for (int frag_idx = 0; frag_idx < fragments; frag_idx++) {
+        int base_idx = socket_state(sockfd)->recv_info.base_idx;
+        const char *data = bufs->recv_buffer[base_idx];
+        size_t data_len = bufs->recv_lengths[base_idx];
+        size_t used = 0;
         
-        // Find which sequence number maps to this buffer slot
-        for (int seq_idx = 0; seq_idx < MAX_SEQ_NUM; seq_idx++) {
-            if (shared_mem[sockfd].rwnd.slots[seq_idx] == base_idx) {
-                found_seq = seq_idx;
-                break;
+        while (used < data_len && iov_idx < msg->msg_iovlen) {
+            struct iovec *iov = &msg->msg_iov[iov_idx];
+            size_t copy_len = iov->iov_len - iov_off;
+            copy_len = (data_len - used < copy_len) ? data_len - used : copy_len;
+            memcpy((char *)iov->iov_base + iov_off, data + used, copy_len);
+            used += copy_len;
+            iov_off += copy_len;
+            if (iov_off == iov->iov_len) {
+                iov_idx++;
+                iov_off = 0;
             }
         }
+        copied += used;
+        truncated |= used < data_len;
+        *ring |= release_recv_slot(sockfd, bufs);
+    }
+    msg->msg_flags = truncated ? MSG_TRUNC : 0;
+    
+    // Set source address if requested
+    if (msg->msg_name != NULL) {
+        struct sockaddr_in addr_in;
+        memset(&addr_in, 0, sizeof(addr_in));
+        addr_in.sin_family = AF_INET;
+        addr_in.sin_port = htons(socket_state(sockfd)->sock_info.port);
+        if (inet_pton(AF_INET, socket_state(sockfd)->sock_info.ip_addr, &(addr_in.sin_addr)) <= 0) {
+            // Should never happen but just in case
+            memset(&(addr_in.sin_addr), 0, sizeof(addr_in.sin_addr));
+        }
+        size_t name_len = (msg->msg_namelen < sizeof(addr_in)) ? msg->msg_namelen : sizeof(addr_in);
+        memcpy(msg->msg_name, &addr_in, name_len);
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+    }
+    return copied;
+}
+
+/* Dequeue up to vlen messages of an unconnected socket from its peers, taking the
+ * peers in turn from where the last call stopped so that none is starved. Blocks like
+ * k_recvfrom until one has a complete in-order message; R() bumps the socket's
+ * recv_event for data of any peer. A message too big for a peer's receive buffer is
+ * dropped (caller holds the lock of sockfd, which the peers share and which is
+ * released here) */
+static int recv_from_peers(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags) {
+    int64_t deadline = socket_state(sockfd)->recv_timeout;
+    deadline = (deadline > 0) ? monotonic_ns() + deadline : 0;
+    int ring = 0;
+    unsigned int received = 0;
+    
+    while (1) {
+        if (socket_buffers(sockfd) == NULL) {
+            errno = EINVAL;  // Closed by another thread meanwhile
+            break;
+        }
         
-        if (found_seq >= 0) {
-            // Mark current sequence slot as unused
-            shared_mem[sockfd].rwnd.slots[found_seq] = -1;
-            
-            // Allocate a future sequence number to this buffer slot
-            int new_seq = (found_seq + BUFFER_SIZE) % MAX_SEQ_NUM;
-            shared_mem[sockfd].rwnd.slots[new_seq] = base_idx;
-            
-            // Advance base pointer to next slot
-            shared_mem[sockfd].recv_info.base_idx = (base_idx + 1) % BUFFER_SIZE;
-            
-            // Update receiver window size
-            if (shared_mem[sockfd].rwnd.size < BUFFER_SIZE) {
-                shared_mem[sockfd].rwnd.size++;
-                
-                // If we transitioned from full to having space, set flag for window update
-                if (shared_mem[sockfd].rwnd.size == 1) {
-                    shared_mem[sockfd].buffer_full = 1;
-                }
+        int peer_count = shared_mem[sockfd].sock_info.peers;
+        int first = shared_mem[sockfd].recv_info.next_peer;
+        for (int probe = 0; probe < peer_count && received < vlen; probe++) {
+            int peer_idx = (first + probe) % peer_count;
+            int peer = PEER_SOCKET(sockfd, peer_idx);
+            SOCKET_BUFFERS *peer_bufs = socket_buffers(peer);
+            if (peer_bufs == NULL) {
+                continue;
+            }
+            ring |= drop_discarded_fragments(peer, peer_bufs);
+            if (message_fragments(peer, peer_bufs) < 0) {
+                socket_state(peer)->recv_info.discard = 1;
+                ring |= drop_discarded_fragments(peer, peer_bufs);
+            }
+            unsigned int read_before = received;
+            while (received < vlen && message_fragments(peer, peer_bufs) > 0) {
+                msgvec[received].msg_len = dequeue_message(peer, peer_bufs, &msgvec[received].msg_hdr, &ring);
+                received++;
+                shared_mem[sockfd].recv_info.next_peer = (peer_idx + 1) % peer_count;
+            }
+            if (received > read_before) {
+                socket_state(peer)->last_active = monotonic_ns();  // Not idle while being read, see expire_peers()
             }
         }
         
-        // Set source address if requested
-        if (src_addr && addrlen) {
-            struct sockaddr_in *addr_in = (struct sockaddr_in *)src_addr;
-            addr_in->sin_family = AF_INET;
-            addr_in->sin_port = htons(shared_mem[sockfd].sock_info.port);
-            if (inet_pton(AF_INET, shared_mem[sockfd].sock_info.ip_addr, &(addr_in->sin_addr)) <= 0) {
-                // Should never happen but just in case
-                memset(&(addr_in->sin_addr), 0, sizeof(addr_in->sin_addr));
-            }
-            *addrlen = sizeof(struct sockaddr_in);
+        if (received > 0) {
+            break;
         }
         
-        V(semid_shared_mem);
-        return copy_len;
+        // Peers whose window updates are pending must not wait for the next message
+        if (ring) {
+            unlock_socket(sockfd);
+            ring_doorbell(sockfd);
+            ring = 0;
+            lock_socket(sockfd);
+        }
+        if ((flags & MSG_DONTWAIT) ||
+            wait_socket_event(sockfd, &shared_mem[sockfd].recv_event,
+                              &shared_mem[sockfd].recv_waiters, deadline) < 0) {
+            stats_write_begin(sockfd);
+            SOCKET_STATS(sockfd)->enomessage++;
+            stats_write_end(sockfd);
+            errno = ENOMESSAGE;
+            break;
+        }
     }
     
-    // No data available
-    V(semid_shared_mem);
-    errno = ENOMESSAGE;
-    return -1;
+    unlock_socket(sockfd);
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return (received > 0) ? (int)received : -1;
+}
+
+// Dequeue up to vlen in-order messages in a single critical section. Blocks like
+// k_recvfrom until the first one is available, then takes those already waiting.
+// Returns the number dequeued and stores each length in msg_len; -1 with errno set
+// if none was
+int k_recvmmsg(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags) {
+    retrieve_SHARED_MEMORY();
+    
+    // Validate socket
+    if (sockfd < 0 || sockfd >= N || (msgvec == NULL && vlen > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (vlen == 0) {
+        return 0;
+    }
+    
+    lock_socket(sockfd);
+    
+    // An unconnected socket receives from all of its peers
+    if (!socket_state(sockfd)->sock_info.free && socket_state(sockfd)->sock_info.unconnected) {
+        return recv_from_peers(sockfd, msgvec, vlen, flags);
+    }
+    if (check_socket_mode(sockfd, 0) < 0) {
+        unlock_socket(sockfd);
+        return -1;
+    }
+    
+    int ring = 0;
+    SOCKET_BUFFERS *bufs = wait_recv_slot(sockfd, flags, &ring);
+    if (bufs == NULL) {
+        unlock_socket(sockfd);
+        if (ring) {
+            ring_doorbell(sockfd);
+        }
+        return -1;
+    }
+    
+    unsigned int received = 0;
+    while (received < vlen && message_fragments(sockfd, bufs) > 0) {
+        msgvec[received].msg_len = dequeue_message(sockfd, bufs, &msgvec[received].msg_hdr, &ring);
+        received++;
+    }
+    
+    unlock_socket(sockfd);
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return received;
+}
+
+// Receive one message scattered into msg->msg_iov
+ssize_t k_recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    if (msg == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct k_mmsghdr entry;
+    entry.msg_hdr = *msg;
+    if (k_recvmmsg(sockfd, &entry, 1, flags) < 0) {
+        return -1;
+    }
+    msg->msg_namelen = entry.msg_hdr.msg_namelen;
+    msg->msg_flags = entry.msg_hdr.msg_flags;
+    return entry.msg_len;
+}
+
+// Receive data from a KTP socket
+ssize_t k_recvfrom(int sockfd, void *buf, size_t len, int flags, 
+                  struct sockaddr *src_addr, socklen_t *addrlen) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (src_addr && addrlen) ? src_addr : NULL;
+    msg.msg_namelen = (src_addr && addrlen) ? *addrlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    ssize_t received = k_recvmsg(sockfd, &msg, flags);
+    if (received >= 0 && msg.msg_name != NULL) {
+        *addrlen = msg.msg_namelen;
+    }
+    return received;
+}
+
+// Return the next in-order message where it lies in shared memory, storing its length
+// in *len, without copying it out. Waits like k_recvfrom; the slot is not reused
+// until k_recv_release
+const void *k_recv_peek(int sockfd, size_t *len, int flags) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N || len == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    lock_socket(sockfd);
+    if (check_socket_mode(sockfd, 0) < 0) {
+        unlock_socket(sockfd);
+        return NULL;
+    }
+    
+    int ring = 0;
+    SOCKET_BUFFERS *bufs = wait_recv_slot(sockfd, flags, &ring);
+    if (bufs != NULL && message_fragments(sockfd, bufs) > 1) {
+        // Only a message held in a single slot is contiguous in shared memory
+        errno = EMSGSIZE;
+        bufs = NULL;
+    }
+    if (bufs == NULL) {
+        unlock_socket(sockfd);
+        if (ring) {
+            ring_doorbell(sockfd);
+        }
+        return NULL;
+    }
+    
+    // R() only writes inactive slots, so the message stays put while it is peeked
+    int base_idx = socket_state(sockfd)->recv_info.base_idx;
+    socket_state(sockfd)->recv_info.peeked = 1;
+    *len = bufs->recv_lengths[base_idx];
+    const char *payload = bufs->recv_buffer[base_idx];
+    unlock_socket(sockfd);
+    return payload;
+}
+
+// Free the slot of the message returned by k_recv_peek
+int k_recv_release(int sockfd) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs == NULL || !socket_state(sockfd)->recv_info.peeked) {
+        unlock_socket(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    socket_state(sockfd)->recv_info.peeked = 0;
+    int ring = release_recv_slot(sockfd, bufs);
+    unlock_socket(sockfd);
+    
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return 0;
+}
+
+// Append bytes to a SOCK_KTP_STREAM socket. They are packed into full MAX_MSG_SIZE
+// segments; the last partial one is queued at once only if nothing sent is still
+// unacknowledged or no-delay is set, otherwise S() queues it when the ACKs arrive or
+// after STREAM_FLUSH_DELAY_NS (Nagle). Blocks until every byte is buffered or the send
+// timeout expires, and returns the number of bytes taken
+ssize_t k_write(int sockfd, const void *buf, size_t len) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (check_socket_mode(sockfd, 1) < 0) {
+        unlock_socket(sockfd);
+        return -1;
+    }
+    
+    const char *data = buf;
+    size_t written = 0;
+    int ring = 0;
+    struct send_info *send = &socket_state(sockfd)->send_info;
+    while (written < len) {
+        // A new segment needs a free slot; a partial one already owns the slot of next_seq
+        SOCKET_BUFFERS *bufs = (send->fill == 0) ? wait_send_slot(sockfd, 0, 1) : socket_buffers(sockfd);
+        if (bufs == NULL) {
+            break;
+        }
+        if (send->fill == 0) {
+            send->fill_start = monotonic_ns();
+        }
+        
+        // Top up the segment behind the header space of its slot
+        int slot_idx = send->next_seq & (send->size - 1);
+        size_t chunk = MAX_MSG_SIZE - send->fill;
+        chunk = (len - written < chunk) ? len - written : chunk;
+        memcpy(bufs->send_buffer[slot_idx] + HEADER_SIZE + send->fill, data + written, chunk);
+        send->fill += chunk;
+        written += chunk;
+        
+        if (send->fill == MAX_MSG_SIZE) {
+            ring |= flush_stream_segment(sockfd, bufs);
+        } else if (send->nodelay || socket_state(sockfd)->swnd.start == send->next_seq) {
+            ring |= flush_stream_segment(sockfd, bufs);
+        } else {
+            // S() sends it once the outstanding data is acknowledged or the delay is up
+            ring |= mark_tx_pending(sockfd);
+        }
+    }
+    
+    unlock_socket(sockfd);
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    if (written == 0 && len > 0) {
+        return -1;  // errno set by wait_send_slot
+    }
+    return written;
+}
+
+// Read up to len bytes from a SOCK_KTP_STREAM socket, across segment boundaries.
+// Blocks until at least one byte is available or the receive timeout expires
+ssize_t k_read(int sockfd, void *buf, size_t len) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (check_socket_mode(sockfd, 1) < 0) {
+        unlock_socket(sockfd);
+        return -1;
+    }
+    if (len == 0) {
+        unlock_socket(sockfd);
+        return 0;
+    }
+    
+    int ring = 0;
+    SOCKET_BUFFERS *bufs = wait_recv_slot(sockfd, 0, &ring);
+    if (bufs == NULL) {
+        unlock_socket(sockfd);
+        return -1;
+    }
+    
+    // Take what is wanted from in-order segments, freeing each one used up
+    char *data = buf;
+    size_t done = 0;
+    struct receive_info *recv = &socket_state(sockfd)->recv_info;
+    while (done < len && bufs->recv_active[recv->base_idx]) {
+        int base_idx = recv->base_idx;
+        size_t chunk = bufs->recv_lengths[base_idx] - recv->offset;
+        chunk = (len - done < chunk) ? len - done : chunk;
+        memcpy(data + done, bufs->recv_buffer[base_idx] + recv->offset, chunk);
+        done += chunk;
+        recv->offset += chunk;
+        
+        if (recv->offset == bufs->recv_lengths[base_idx]) {
+            recv->offset = 0;
+            ring |= release_recv_slot(sockfd, bufs);
+        }
+    }
+    
+    unlock_socket(sockfd);
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return done;
+}
+
+// Turn Nagle's packing of small k_write calls off (1) or back on (0) for a stream socket
+int k_set_nodelay(int sockfd, int nodelay) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (check_socket_mode(sockfd, 1) < 0) {
+        unlock_socket(sockfd);
+        return -1;
+    }
+    
+    // A segment held back so far goes out now
+    int ring = 0;
+    socket_state(sockfd)->send_info.nodelay = (nodelay != 0);
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (nodelay && bufs != NULL && socket_state(sockfd)->send_info.fill > 0) {
+        ring = flush_stream_segment(sockfd, bufs);
+    }
+    unlock_socket(sockfd);
+    
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return 0;
 }
 
 // Close a KTP socket
 int k_close(int sockfd) {
     retrieve_SHARED_MEMORY();
-    init_sembuf();
-    
-    P(semid_shared_mem);
     
     // Validate socket
-    if (sockfd < 0 || sockfd >= N || shared_mem[sockfd].sock_info.free) {
-        V(semid_shared_mem);
+    if (sockfd < 0 || sockfd >= N) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    // Give queued messages up to CLOSE_LINGER seconds to be acknowledged
+    int64_t linger_end = monotonic_ns() + CLOSE_LINGER * NSEC_PER_SEC;
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.unconnected) {
+        unlock_socket(sockfd);
+        linger_peers(sockfd, linger_end);
+        
+        // Free the peers before the UDP socket they send on is closed
+        lock_socket(sockfd);
+        release_peers(sockfd);
+    }
+    
+    // A partial stream segment is not held back any longer
+    SOCKET_BUFFERS *bufs = socket_buffers(sockfd);
+    if (bufs != NULL && socket_state(sockfd)->send_info.fill > 0) {
+        if (flush_stream_segment(sockfd, bufs)) {
+            unlock_socket(sockfd);
+            ring_doorbell(sockfd);
+            lock_socket(sockfd);
+        }
+    }
+    while (socket_buffers(sockfd) != NULL &&
+           socket_state(sockfd)->send_info.free_slots < socket_state(sockfd)->send_info.size) {
+        if (wait_socket_event(sockfd, &socket_state(sockfd)->send_event,
+                              &socket_state(sockfd)->send_waiters, linger_end) < 0) {
+            break;
+        }
+    }
+    unlock_socket(sockfd);
+    
+    // Have initksocket close the UDP socket while the slot is still ours, so that
+    // its port can be bound again right away
+    lock_socket(sockfd);
+    int udp_sockid = socket_state(sockfd)->sock_info.free ? -1 : socket_state(sockfd)->sock_info.udp_sockid;
+    unlock_socket(sockfd);
+    if (udp_sockid > 0) {
+        NET_SOCKET request;
+        memset(&request, 0, sizeof(request));
+        request.type = CLOSE_REQUEST;
+        request.sock_id = udp_sockid;
+        submit_request(sockfd, &request);
+    }
+    
+    P(semid_alloc);
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.free) {
+        unlock_socket(sockfd);
+        V(semid_alloc);
         errno = EINVAL;
         return -1;
     }
     
     // Close socket and mark as free
-    shared_mem[sockfd].sock_info.free = 1;
+    socket_state(sockfd)->sock_info.free = 1;
+    int buf_shmid = socket_state(sockfd)->sock_info.buf_shmid;
+    release_socket_buffers(sockfd);
     
-    V(semid_shared_mem);
+    // Threads of this process blocked in k_sendto or k_recvfrom return EINVAL
+    socket_state(sockfd)->recv_event++;
+    socket_state(sockfd)->send_event++;
+    
+    unlock_socket(sockfd);
+    V(semid_alloc);
+    wake_socket_event(&socket_state(sockfd)->recv_event);
+    wake_socket_event(&socket_state(sockfd)->send_event);
+    
+    // The segment goes away once initksocket has detached from it too
+    if (buf_shmid >= 0) {
+        shmctl(buf_shmid, IPC_RMID, NULL);
+    }
     return 0;
 }
 
-// Simulate packet loss
-int dropMessage(float prob) {
-    // Generate random number between 0 and 1
-    double rand_val = (double)rand() / (double)RAND_MAX;
+// Entry of the peer at peer_idx of the unconnected socket sockfd, NULL if it is free; the
+// setters walk the peers with it so that a change reaches those already open as well as
+// later ones, which inherit it from sockfd (caller holds the lock of sockfd)
+static SHARED_MEMORY *live_peer(int sockfd, int peer_idx) {
+    SHARED_MEMORY *peer = socket_state(PEER_SOCKET(sockfd, peer_idx));
+    return peer->sock_info.free ? NULL : peer;
+}
+
+// Select the congestion control algorithm (CC_*) of a socket, and of each of its peers if
+// it is unconnected; the windows start over
+int k_set_congestion(int sockfd, int algorithm) {
+    retrieve_SHARED_MEMORY();
     
-    // Return 1 (drop) if random value is below threshold
-    return (rand_val < prob) ? 1 : 0;
+    // Validate socket and algorithm
+    if (sockfd < 0 || sockfd >= N || algorithm < 0 || algorithm >= CC_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.free) {
+        unlock_socket(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    cc_init(&socket_state(sockfd)->cc, algorithm);
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        SHARED_MEMORY *peer = live_peer(sockfd, peer_idx);
+        if (peer != NULL) {
+            cc_init(&peer->cc, algorithm);
+        }
+    }
+    unlock_socket(sockfd);
+    return 0;
+}
+
+// Limit how long k_recvfrom and k_sendto block, in milliseconds (0 for no limit); for an
+// unconnected socket this covers k_sendto to each of its peers
+int k_set_timeout(int sockfd, int recv_timeout_ms, int send_timeout_ms) {
+    retrieve_SHARED_MEMORY();
+    
+    // Validate socket and timeouts
+    if (sockfd < 0 || sockfd >= N || recv_timeout_ms < 0 || send_timeout_ms < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.free) {
+        unlock_socket(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    socket_state(sockfd)->recv_timeout = (int64_t)recv_timeout_ms * 1000000;
+    socket_state(sockfd)->send_timeout = (int64_t)send_timeout_ms * 1000000;
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        SHARED_MEMORY *peer = live_peer(sockfd, peer_idx);
+        if (peer != NULL) {
+            peer->recv_timeout = socket_state(sockfd)->recv_timeout;
+            peer->send_timeout = socket_state(sockfd)->send_timeout;
+        }
+    }
+    unlock_socket(sockfd);
+    return 0;
+}
+
+// Hold back the ACK for in-order data until a second packet arrives or delay_us
+// microseconds pass; 0 acknowledges every packet at once. An unconnected socket's peers
+// acknowledge the data they receive, so the delay is set for each of them
+int k_set_ack_delay(int sockfd, int delay_us) {
+    retrieve_SHARED_MEMORY();
+    
+    // Validate socket and delay
+    if (sockfd < 0 || sockfd >= N || delay_us < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.free) {
+        unlock_socket(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    socket_state(sockfd)->ack.delay = (int64_t)delay_us * 1000;
+    
+    // An ACK held back so far goes out now
+    int ring = 0;
+    if (delay_us == 0 && socket_state(sockfd)->ack.due != 0) {
+        socket_state(sockfd)->ack.due = monotonic_ns();
+        ring = mark_tx_pending(sockfd);
+    }
+    for (int peer_idx = 0; peer_idx < shared_mem[sockfd].sock_info.peers; peer_idx++) {
+        SHARED_MEMORY *peer = live_peer(sockfd, peer_idx);
+        if (peer == NULL) {
+            continue;
+        }
+        peer->ack.delay = (int64_t)delay_us * 1000;
+        if (delay_us == 0 && peer->ack.due != 0) {
+            peer->ack.due = monotonic_ns();
+            ring |= mark_tx_pending(PEER_SOCKET(sockfd, peer_idx));
+        }
+    }
+    unlock_socket(sockfd);
+    if (ring) {
+        ring_doorbell(sockfd);
+    }
+    return 0;
 }
+
+// Check that every probability of an impairment is within [0, 1] and no time or rate is negative
+static int valid_impairment(const struct ktp_impairment *impairment) {
+    double probabilities[] = { impairment->loss, impairment->gilbert_p, impairment->gilbert_r,
+                               impairment->gilbert_loss_bad, impairment->duplicate, impairment->reorder };
+    for (size_t prob_idx = 0; prob_idx < sizeof(probabilities) / sizeof(probabilities[0]); prob_idx++) {
+        if (!(probabilities[prob_idx] >= 0.0 && probabilities[prob_idx] <= 1.0)) {
+            return 0;  // Also rejects NaN
+        }
+    }
+    return impairment->loss_model >= LOSS_NONE && impairment->loss_model <= LOSS_GILBERT &&
+           impairment->reorder_gap_us >= 0 && impairment->delay_us >= 0 &&
+           impairment->jitter_us >= 0 && impairment->rate_kbps >= 0;
+}
+
+// Set how R() impairs the packets a socket receives; the random numbers start over
+// from impairment->seed. Packets already held back keep their release times. R()
+// impairs what an unconnected socket receives before handing it to the peers, so
+// this covers all of them
+int k_set_impairment(int sockfd, const struct ktp_impairment *impairment) {
+    retrieve_SHARED_MEMORY();
+    
+    // Validate socket and impairment
+    if (sockfd < 0 || sockfd >= N || impairment == NULL || !valid_impairment(impairment)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.free) {
+        unlock_socket(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    socket_state(sockfd)->impair = *impairment;
+    reset_impairment(sockfd);
+    unlock_socket(sockfd);
+    return 0;
+}
+
+// Copy the impairment of a socket into *impairment
+int k_get_impairment(int sockfd, struct ktp_impairment *impairment) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N || impairment == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    lock_socket(sockfd);
+    if (socket_state(sockfd)->sock_info.free) {
+        unlock_socket(sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+    *impairment = socket_state(sockfd)->impair;
+    unlock_socket(sockfd);
+    return 0;
+}
+
+/* Apply a specification such as "gilbert=0.01:0.3:0.8,delay=2000,jitter=500" to
+ * *impairment, as taken by initksocket -I and ktp_bench -I; returns -1 on an unknown
+ * key or a malformed value */
+int k_parse_impairment(char *spec, struct ktp_impairment *impairment) {
+    for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *value = strchr(item, '=');
+        if (strcmp(item, "none") == 0) {
+            impairment_defaults(impairment);
+            continue;
+        }
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        
+        int parsed = 1;
+        if (strcmp(item, "loss") == 0) {
+            parsed = sscanf(value, "%lf", &impairment->loss);
+            if (impairment->loss_model == LOSS_NONE) {
+                impairment->loss_model = LOSS_BERNOULLI;
+            }
+        } else if (strcmp(item, "gilbert") == 0) {
+            parsed = (sscanf(value, "%lf:%lf:%lf", &impairment->gilbert_p, &impairment->gilbert_r,
+                             &impairment->gilbert_loss_bad) == 3);
+            impairment->loss_model = LOSS_GILBERT;
+        } else if (strcmp(item, "duplicate") == 0) {
+            parsed = sscanf(value, "%lf", &impairment->duplicate);
+        } else if (strcmp(item, "reorder") == 0) {
+            parsed = (sscanf(value, "%lf:%d", &impairment->reorder, &impairment->reorder_gap_us) == 2);
+        } else if (strcmp(item, "delay") == 0) {
+            parsed = sscanf(value, "%d", &impairment->delay_us);
+        } else if (strcmp(item, "jitter") == 0) {
+            parsed = sscanf(value, "%d", &impairment->jitter_us);
+        } else if (strcmp(item, "rate") == 0) {
+            parsed = sscanf(value, "%d", &impairment->rate_kbps);
+        } else if (strcmp(item, "seed") == 0) {
+            unsigned long long seed;
+            parsed = sscanf(value, "%llu", &seed);
+            impairment->seed = seed;
+        } else {
+            return -1;
+        }
+        if (parsed != 1) {
+            return -1;
+        }
+    }
+    return valid_impairment(impairment) ? 0 : -1;
+}
+
+// Copy a consistent snapshot of a socket's counters into *stats without taking the
+// socket lock, so that watching a socket never slows it down. Retries while an update
+// is in progress or one happened during the copy
+int k_get_stats(int sockfd, struct ktp_stats *stats) {
+    retrieve_SHARED_MEMORY();
+    
+    if (sockfd < 0 || sockfd >= N || stats == NULL || socket_state(sockfd)->sock_info.free) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct ktp_stats *shared = SOCKET_STATS(sockfd);
+    uint32_t seq_before, seq_after;
+    do {
+        seq_before = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        memcpy(stats, shared, sizeof(*stats));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq_after = __atomic_load_n(&shared->seq, __ATOMIC_RELAXED);
+    } while ((seq_before & 1) || seq_before != seq_after);
+    return 0;
+}
+
@@ -22,92 +22,449 @@
 #include <sys/shm.h>
 #include <sys/sem.h>
 #include <time.h>
+#include <stdint.h>
 
 // Configuration parameters
-#define T 5             // Timeout period in seconds
-#define DROP_PROB 0.05  // Message drop probability
+#define T 5             // GC period in seconds; S() also checks the timers at least every T/2
+#define INITIAL_RTO_NS 1000000000LL   // Retransmission timeout until the first RTT sample (1 s, RFC 6298)
+#define MIN_RTO_NS 1000000LL          // Lower bound of the adaptive timeout (1 ms)
+#define MAX_RTO_NS 60000000000LL      // Upper bound of the backed-off timeout (60 s)
+#define NSEC_PER_SEC 1000000000LL
+#define CLOSE_LINGER 60 // Seconds k_close waits for queued messages to be acknowledged
+#define STREAM_FLUSH_DELAY_NS 40000000LL  // Longest a partial stream segment is held back (40 ms)
+#define ACK_DELAY_NS 500000LL   // Default longest wait for a second packet to ACK (0.5 ms), below MIN_RTO_NS
+#define ACK_EVERY 2             // In-order DATA packets acknowledged together by a delayed ACK
+#define IMPAIR_SEED 0x4b5450  // Default seed of every socket's impairment random numbers
 #define SOCK_KTP 3      // Socket type for KTP
+#define SOCK_KTP_STREAM 4 // Socket type for KTP byte streams, see k_write / k_read
 #define N 10            // Maximum number of KTP sockets
-#define MAX_MSG_SIZE 512 // Fixed message size
-#define MAX_SEQ_NUM 256 // Maximum sequence number (8 bits)
-#define BUFFER_SIZE 10  // Size of buffer (in number of messages)
+#define MAX_MSG_SIZE 512 // Payload of one packet; longer messages are sent as fragments
+#define MAX_MESSAGE_SIZE (1 << 20)  // Largest message k_sendto accepts (in bytes)
+#define DEFAULT_BUFFER_SIZE 256 // Send/receive buffer size used by k_socket (in messages)
+#define MAX_BUFFER_SIZE 4096    // Largest buffer k_socket_sized accepts (in messages)
+#define INITIAL_CWND 4          // Congestion window of a new socket (in messages)
+#define DUPACK_THRESHOLD 3      // Duplicate ACKs that signal a lost message
+#define TLP_SRTT_FACTOR 2       // A tail-loss probe goes out this many SRTTs after the last send
+#define CC_REPORT_PERIOD 10     // Seconds between congestion control reports of initksocket
+#define R_EVENT_BATCH 64        // Most epoll events R() handles per wakeup
+#define RECV_BATCH 32           // Most datagrams R() reads from a socket per recvmmsg()
+#define SEND_BATCH 64           // Most datagrams the daemon sends per sendmmsg()
+#define MAX_WORKERS 8           // Most workers initksocket shards the sockets across
+#define IMPAIR_QUEUE_SIZE 1024  // Packets a worker can hold back for impairment delays, dropped beyond
+#define MAX_PEERS 4096          // Peers an unconnected socket can talk to at once
+#define PEER_TABLE_SIZE (2 * MAX_PEERS)  // Buckets of an unconnected socket's peer table, a power of two
+#define PEER_BUFFER_SIZE 16     // Largest send/receive buffer of one peer (in messages)
+#define PEER_IDLE_TIMEOUT 60    // Seconds a peer with nothing in flight is kept after its last packet
+#define CACHE_LINE_SIZE 64      // Unit of false sharing between the processes and threads
+
+// n rounded up to a whole number of cache lines
+#define CACHE_ALIGN(n) (((n) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1))
+
+/* KTP socket numbers from N on stand for the peers of unconnected sockets, whose
+ * entries live in the buffer segment of their socket and share its lock; see
+ * open_peer(). PARENT_SOCKET is the slot a socket number belongs to */
+#define PEER_SOCKET(sockfd, peer_idx) (N + (sockfd) * MAX_PEERS + (peer_idx))
+#define IS_PEER(sockfd) ((sockfd) >= N)
+#define PARENT_SOCKET(sockfd) (IS_PEER(sockfd) ? ((sockfd) - N) / MAX_PEERS : (sockfd))
+#define PEER_INDEX(sockfd) (((sockfd) - N) % MAX_PEERS)
+
+// Distance from sequence number b to a, negative if a is before b (handles wraparound)
+#define SEQ_DIFF(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)))
 
 // Semaphore macros
 #define P(s) semop(s, &sem_decrement, 1)
 #define V(s) semop(s, &sem_increment, 1)
 
+/* Lock ordering (acquire top to bottom, release in reverse):
+ *   1. semid_alloc            - slot table (sock_info.free / sock_info.pid)
+ *   2. semid_shared_mem[i]    - one SHARED_MEMORY entry, lower index first; the
+ *                               peers of an unconnected socket take its lock
+ *   3. semid_net_socket       - daemon request queue
+ * sock_info.free and sock_info.pid are written with both 1 and 2 held and
+ * may be read with either. No socket system call is made while 1 or 2 is held.
+ * semid_doorbell is not a lock: one semaphore per worker counts wakeups for
+ * its S() and is only signalled after the socket lock has been released. */
+
 // Custom error codes
 #define ENOTBOUND 200   // Not bound to destination
 #define ENOSPACE 201    // No space available
 #define ENOMESSAGE 202  // No message available
 
+// Congestion control algorithms, selected per socket with k_set_congestion()
+#define CC_NONE 0       // Limited by the receiver window only
+#define CC_AIMD 1       // +1 message per RTT, halve on loss
+#define CC_NEWRENO 2    // Slow start, AIMD and NewReno fast recovery (RFC 5681, RFC 6582)
+#define CC_CUBIC 3      // Cubic window growth (RFC 8312) with NewReno fast recovery
+#define CC_COUNT 4
+#define DEFAULT_CC CC_NEWRENO
+
+// Loss models of the impairment stage
+#define LOSS_NONE 0        // No packet is lost
+#define LOSS_BERNOULLI 1   // Every packet is lost independently with probability loss
+#define LOSS_GILBERT 2     // Gilbert-Elliott: bursts of loss while in a bad state
+
 // Message types
-#define DATA_MSG '1'
-#define ACK_MSG '0'
+#define DATA_MSG 1
+#define ACK_MSG 0
+
+// Fragment flags of a DATA packet, carried in its window field. A message longer than
+// MAX_MSG_SIZE takes consecutive sequence numbers: the first fragment has FRAG_MORE,
+// the middle ones FRAG_MORE | FRAG_CONT and the last FRAG_CONT. A whole message has 0
+#define FRAG_MORE 0x1      // Another fragment of the message follows
+#define FRAG_CONT 0x2      // Continues the message of the previous sequence number
+
+// Wire format version; version 1 spelled each header bit as an ASCII '0'/'1'
+#define KTP_VERSION 2
+
+// Header at the start of every KTP packet, all fields in network byte order
+typedef struct ktp_header {
+    uint8_t version;       // KTP_VERSION of the sending daemon
+    uint8_t type;          // DATA_MSG or ACK_MSG
+    uint16_t length;       // DATA: payload length, ACK: bytes of SACK blocks that follow
+    uint32_t seq;          // DATA: sequence number, ACK: last in-order sequence
+    uint32_t window;       // ACK: free receive buffer slots, DATA: FRAG_* flags
+} KTP_HEADER;
+
+#define HEADER_SIZE ((int)sizeof(KTP_HEADER))
+
+// Selective acknowledgement: a range [start, end) received beyond the cumulative ACK
+typedef struct sack_block {
+    uint32_t start;        // First sequence number of the range (network byte order)
+    uint32_t end;          // One past the last sequence number (network byte order)
+} SACK_BLOCK;
+
+#define MAX_SACK_BLOCKS 4  // Ranges reported per ACK, lowest sequence numbers first
+#define MAX_ACK_SIZE (HEADER_SIZE + MAX_SACK_BLOCKS * (int)sizeof(SACK_BLOCK))
+
+// A send slot holds the DATA header in front of the message, so S() transmits
+// straight from the slot; the message itself starts HEADER_SIZE bytes in. Slots are
+// padded to whole cache lines so that S() writing one header never shares a line
+// with k_sendto filling the next slot
+#define SEND_SLOT_SIZE CACHE_ALIGN(HEADER_SIZE + MAX_MSG_SIZE)
 
 // Flow control window structure
 typedef struct window {
-    int slots[MAX_SEQ_NUM];  // Window entries (buffer indices or -1 if not used)
+    uint32_t start;        // swnd: oldest unacknowledged sequence, rwnd: next expected sequence
     int size;              // Current window size
-    int start;             // Start position of the window
 } window;
 
-// Socket information structure
+// Control requests of k_socket, k_bind and k_close, handled by create_and_bind() in initksocket
+#define CREATE_REQUEST 1   // Create a UDP socket and the buffer segment
+#define BIND_REQUEST 2     // Bind the UDP socket sock_id to ip_addr:port, for an
+                           // unconnected socket with a buffer segment that holds peers
+#define CLOSE_REQUEST 3    // Close the UDP socket sock_id
+
+// States of a request queue slot
+#define REQUEST_EMPTY 0    // Free for the owner of the KTP socket
+#define REQUEST_PENDING 1  // Queued, waiting for initksocket
+#define REQUEST_BUSY 2     // Being handled by initksocket
+#define REQUEST_DONE 3     // Reply written, the owner has not collected it yet
+
+// Control request and reply, one queue slot
 typedef struct net_socket {
+    int state;             // REQUEST_* state of the slot
+    int type;              // CREATE_REQUEST or BIND_REQUEST
+    uint32_t ticket;       // Queue position, lower tickets are handled first
     int sock_id;           // UDP socket ID
     char ip_addr[INET_ADDRSTRLEN]; // IP address
     uint16_t port;         // Port number
     int err_code;          // Error code
+    int send_size;         // Create request: send buffer size (in messages)
+    int recv_size;         // Create request: receive buffer size (in messages)
+    int unconnected;       // Bind request: 1 to make room for peers in a new buffer segment
+    int buf_shmid;         // Create / bind reply: segment holding the socket's buffers
 } NET_SOCKET;
 
+/* Network impairment R() applies to the packets a socket receives before the protocol
+ * sees them, set with k_set_impairment. A packet that is not lost may be duplicated;
+ * each copy then waits for the rate cap, the delay with its jitter, and with
+ * probability reorder another reorder_gap_us so that later packets overtake it. The
+ * random numbers come from seed alone, so a run with the same traffic is repeatable */
+struct ktp_impairment {
+    int loss_model;            // LOSS_* constant
+    double loss;               // Bernoulli: loss probability, Gilbert: the same in the good state
+    double gilbert_p;          // Gilbert: probability per packet of going from the good to the bad state
+    double gilbert_r;          // Gilbert: probability per packet of going back from bad to good
+    double gilbert_loss_bad;   // Gilbert: loss probability in the bad state
+    double duplicate;          // Probability that a packet arrives twice
+    double reorder;            // Probability that a packet is held back by reorder_gap_us
+    int reorder_gap_us;        // Extra delay of a reordered packet (us)
+    int delay_us;              // Fixed one-way delay (us)
+    int jitter_us;             // The delay varies uniformly by up to this much either way (us)
+    int rate_kbps;             // Bandwidth cap in kbit/s, wire bytes including headers; 0 for none
+    uint64_t seed;             // Seed of the random numbers
+};
+
+/* Requests are queued in the slot of the KTP socket they are made for, so every
+ * socket can have one request in flight and processes never wait for each other.
+ * semid_init counts queued requests and semid_ktp is a set of N semaphores, one
+ * per slot, on which the owner waits for its reply. */
+typedef struct request_queue {
+    uint32_t next_ticket;          // Ticket of the next queued request
+    NET_SOCKET requests[N];        // Indexed like shared_mem
+    struct ktp_impairment impairment;  // Impairment of every new socket, initksocket -I
+} REQUEST_QUEUE;
+
 struct sock_info {
     int free;              // 1 if socket is free, 0 if allocated
     pid_t pid;             // Process ID
     int udp_sockid;        // Associated UDP socket ID
+    int buf_shmid;         // Buffer segment of this socket, -1 until k_socket completes
+    int stream;            // 1 for SOCK_KTP_STREAM, 0 for SOCK_KTP
+    int worker;            // Worker of initksocket serving the socket, set at k_socket time
+    int unconnected;       // 1 if bound without a destination, its messages go through peers
+    int peers;             // Unconnected: peer entries ever used in the buffer segment, see open_peer()
+    int free_peers;        // Unconnected: entries of expired peers on peer_free, reused first
     char ip_addr[INET_ADDRSTRLEN];  // Destination IP address
     uint16_t port;         // Destination port
 };
 
+/* The message buffers of a socket live in their own shared memory segment,
+ * created by initksocket at k_socket time and sized from send_info.size and
+ * recv_info.size. Both sizes are powers of two, so the slot of a sequence
+ * number is seq & (size - 1) and stays consistent when seq wraps around. */
 struct send_info{
-    // Send buffer
-    char buffer[BUFFER_SIZE][MAX_MSG_SIZE];
+    int size;             // Capacity of the send buffer (in messages)
     int free_slots;       // Available space in send buffer
-    int lengths[BUFFER_SIZE];  // Actual data length for each buffer slot
-    time_t timestamps[MAX_SEQ_NUM];  // Timestamp of last send for each sequence
+    uint32_t next_seq;    // Sequence number given to the next k_sendto message
+    int reserved;         // 1 while k_send_reserve has handed out the slot of next_seq
+    int fill;             // Stream: bytes k_write put in the slot of next_seq, not yet queued
+    int64_t fill_start;   // Stream: CLOCK_MONOTONIC ns when the first of them was written
+    int nodelay;          // Stream: queue partial segments at once, see k_set_nodelay
+};
+
+// Round-trip estimator of a socket (RFC 6298), all times in nanoseconds
+struct rtt_info {
+    int64_t srtt;              // Smoothed round-trip time, 0 until the first sample
+    int64_t rttvar;            // Round-trip time variation
+    int64_t rto;               // Current retransmission timeout, including backoff
+    int64_t timer_due;         // No retransmission timer expires before this (ns), 0 to scan them
+};
+
+// Congestion state of a socket's sending side, see congestion.c. Windows are in messages
+struct cong_info {
+    int algorithm;             // CC_* constant
+    int cwnd;                  // Congestion window
+    int cwnd_cnt;              // Messages acknowledged toward the next window increase
+    int ssthresh;              // Slow start threshold
+    int dupacks;               // Duplicate ACKs since swnd.start last advanced
+    int in_recovery;           // 1 during fast recovery
+    uint32_t recover;          // No new reduction until swnd.start reaches this sequence
+    uint32_t high_seq;         // One past the highest sequence number sent
+    int w_max;                 // CUBIC: window before the last reduction
+    double cubic_k;            // CUBIC: seconds until the window is back at w_max
+    int64_t epoch_start;       // CUBIC: start of the current growth epoch (ns), 0 if none
+    int64_t created;           // CLOCK_MONOTONIC ns when the algorithm was selected
+    uint64_t delivered;        // Messages acknowledged in total
+    uint64_t reported;         // delivered at the last congestion control report
+    uint32_t loss_events;      // Window reductions, including timeouts
+    uint32_t timeouts;         // Reductions caused by an expired oldest message
+};
+
+// Loss recovery of a socket's sending side ahead of the retransmission timers
+struct loss_info {
+    int rexmit_pending;        // 1 if S() should resend the messages found lost in fast recovery
+    int64_t recovery_start;    // CLOCK_MONOTONIC ns when the current fast recovery began
+    int tlp_sent;              // 1 while a tail-loss probe is waiting for its ACK
+    uint32_t tlp_high;         // cc.high_seq when the last probe was sent, one probe per tail
+    int64_t tlp_at;            // CLOCK_MONOTONIC ns of that probe; no timer expires sooner
+                               // than an RTO after it (RFC 8985)
+    uint32_t sacked_high;      // One past the highest sequence number the receiver SACKed
+    uint32_t timeout_high;     // cc.high_seq at the last timeout of the oldest message
+    int64_t timeout_at;        // CLOCK_MONOTONIC ns of that timeout; what was sent before it
+                               // and below timeout_high counts as lost
+    uint32_t fast_retransmits; // Messages resent in fast recovery
+    uint32_t tail_probes;      // Tail-loss probes sent
+};
+
+// Acknowledgements of a socket's receiving side, delayed as set by k_set_ack_delay
+struct ack_info {
+    uint32_t high_seq;         // One past the highest sequence number received
+    int64_t delay;             // Longest an ACK for in-order data is held back (ns), 0 to ACK every packet
+    int unacked;               // In-order DATA packets received since the last ACK
+    int64_t due;               // CLOCK_MONOTONIC ns by which S() sends the held-back ACK, 0 if none
+    uint64_t data_received;    // DATA packets received in total
+    uint64_t acks_sent;        // ACKs sent in total, window updates included
+    uint64_t reported;         // data_received at the last ACK report
+};
+
+/* Counters of a socket for ktpstat and k_get_stats. Every update happens under the
+ * socket lock between stats_write_begin() and stats_write_end(), which make seq odd
+ * while it is in progress, so readers take consistent snapshots without the lock by
+ * retrying until seq is even and unchanged across their copy (a seqlock) */
+struct ktp_stats {
+    uint32_t seq;              // Seqlock sequence, odd while an update is in progress
+    uint64_t packets_sent;     // DATA packets sent, retransmissions included
+    uint64_t bytes_sent;       // Payload bytes of those packets
+    uint64_t packets_received; // DATA packets received, duplicates included
+    uint64_t bytes_received;   // Payload bytes of those packets
+    uint64_t retransmits;      // DATA packets sent again: timeouts, fast retransmits and probes
+    uint64_t duplicates;       // DATA packets already received or beyond the receive window
+    uint64_t acks_sent;        // ACKs sent, window updates included
+    uint64_t acks_received;    // ACKs received
+    uint64_t dupacks;          // ACKs that only reported data received out of order
+    uint64_t drops;            // Received packets lost by the impairment stage or its full queue
+    uint64_t zero_windows;     // Times the peer's window closed with messages still queued
+    uint64_t enospace;         // k_sendto and friends failing with ENOSPACE
+    uint64_t enomessage;       // k_recvfrom and friends failing with ENOMESSAGE
+    int64_t srtt;              // Smoothed round-trip time (ns), 0 until the first sample
+    int64_t rto;               // Retransmission timeout (ns)
+    int cwnd;                  // Congestion window (messages)
+};
+
+// Impairment state of a socket, kept by R() between packets
+struct impair_state {
+    uint64_t random;           // xorshift64* generator state, never 0
+    int bad;                   // Gilbert: 1 while in the bad state
+    int64_t link_free;         // Rate cap: CLOCK_MONOTONIC ns when the last packet has gone through
 };
 
 struct receive_info{
-    // Receive buffer
-    char buffer[BUFFER_SIZE][MAX_MSG_SIZE];
-    int active[BUFFER_SIZE];   // 1 if slot contains valid data, 0 otherwise
-    int lengths[BUFFER_SIZE];  // Length of received data
+    int size;                  // Capacity of the receive buffer (in messages)
     int base_idx;              // Base index of the receive buffer
+    int peeked;                // 1 while k_recv_peek has handed out the slot at base_idx
+    int discard;               // 1 while dropping the rest of a message too big for the buffer
+    int offset;                // Stream: bytes of the message at base_idx k_read consumed
+    int next_peer;             // Unconnected: peer k_recvfrom looks at first
 };
 
-// Shared memory structure for each KTP socket
-typedef struct shared_memory {    
+// Addresses of one socket's buffers inside this process, see socket_buffers()
+typedef struct socket_buffers {
+    int shmid;                 // Attached segment, -1 if none
+    void *base;                // Address the segment is attached at
+    int64_t *send_timestamps;  // CLOCK_MONOTONIC ns of last send for each slot (-1 if not sent)
+    int *send_lengths;         // Actual data length for each send slot
+    int *send_sacked;          // 1 if the receiver selectively acknowledged the slot
+    int *send_retries;         // Times the slot was retransmitted (Karn's rule)
+    int *send_flags;           // FRAG_* flags of the fragment in each slot
+    char (*send_buffer)[SEND_SLOT_SIZE];  // Header space, then the message
+    uint32_t *recv_seqs;       // Sequence number held by each receive slot
+    int *recv_active;          // 1 if slot contains valid data, 0 otherwise
+    int *recv_lengths;         // Length of received data
+    int *recv_flags;           // FRAG_* flags of the fragment in each slot
+    char (*recv_buffer)[MAX_MSG_SIZE];
+    int *peer_table;           // Unconnected: index of each peer hashed by address, -1 if empty
+    int *peer_free;            // Unconnected: indices of the entries of expired peers
+    struct shared_memory *peer_states;  // Unconnected: the entries of its MAX_PEERS peers
+    char *peer_area;           // Unconnected: the buffers of its peers, one after the other
+    struct socket_buffers *peers;  // Unconnected: this process's view of each peer's buffers
+} SOCKET_BUFFERS;
+
+/* Shared memory structure for each KTP socket. The fields are grouped by who
+ * writes them, each group starting on its own cache line, so that the calls of
+ * the application and the R() / S() threads of initksocket do not keep taking
+ * the same lines from each other. Every entry is a whole number of lines, so
+ * neighbouring sockets never share one either. */
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+typedef struct shared_memory {
+    // Set up by k_socket / k_bind / k_set_timeout / k_set_impairment, read on every call afterwards
     struct sock_info sock_info;  // Socket information
-    struct send_info send_info;  // Send buffer information
-    struct receive_info recv_info;  // Receive buffer information     
-    window swnd;           // Sending window
+    int64_t recv_timeout;  // k_recvfrom blocks at most this long (ns), 0 for no limit
+    int64_t send_timeout;  // k_sendto blocks at most this long (ns), 0 for no limit
+    struct ktp_impairment impair;  // Impairment of received packets
+    
+    // Written by the application's calls for every message
+    struct send_info send_info CACHE_ALIGNED;  // Send buffer information
+    struct receive_info recv_info;  // Receive buffer information
+    int recv_waiters;      // Callers sleeping on recv_event
+    int send_waiters;      // Callers sleeping on send_event
+    
+    // Written by R() and S() for every packet
+    window swnd CACHE_ALIGNED;  // Sending window
     window rwnd;           // Receiving window
     int buffer_full;       // Flag to indicate no space in receive buffer
-} SHARED_MEMORY;
+    int tx_pending;        // 1 if S() should transmit new data or a window update for this socket
+    uint32_t recv_event;   // Futex word, bumped when in-order data becomes readable
+    uint32_t send_event;   // Futex word, bumped when send buffer slots are freed
+    struct rtt_info rtt;   // Retransmission timeout estimator for swnd
+    struct cong_info cc;   // Congestion window, also bounding swnd
+    struct loss_info loss; // Fast retransmit and tail-loss probes for swnd
+    struct ack_info ack;   // ACKs for rwnd
+    struct impair_state impair_state;  // Random numbers and link of the impairment stage
+    int64_t last_active;   // Peer: CLOCK_MONOTONIC ns of its opening, last packet received or last read
+    
+    // Written by both sides under the seqlock, read by ktpstat without any lock
+    struct ktp_stats stats CACHE_ALIGNED;
+} CACHE_ALIGNED SHARED_MEMORY;
+
+// One message of k_sendmmsg / k_recvmmsg, laid out like struct mmsghdr
+struct k_mmsghdr {
+    struct msghdr msg_hdr;     // msg_name is the peer, optional when sending
+    unsigned int msg_len;      // Bytes queued or received
+};
 
 // External variables
 extern SHARED_MEMORY *shared_mem;
-extern NET_SOCKET *net_socket;
+extern REQUEST_QUEUE *request_queue;
 extern struct sembuf sem_decrement, sem_increment;
-extern int semid_shared_mem, semid_net_socket;
+extern int semid_shared_mem, semid_net_socket;  // semid_shared_mem is a set of N semaphores
+                                                // semid_net_socket guards request_queue
+extern int semid_alloc;
+extern int semid_doorbell;  // Set of MAX_WORKERS semaphores, rung to wake a worker's S()
 extern int shmid_shared_mem, shmid_net_socket;
-extern int semid_init, semid_ktp;
+extern int semid_init, semid_ktp;               // semid_ktp is a set of N semaphores
 
 // Function prototypes
 int k_socket(int domain, int type, int protocol);
+int k_socket_sized(int domain, int type, int protocol, int send_size, int recv_size);
 int k_bind(char src_ip[], uint16_t src_port, char dest_ip[], uint16_t dest_port);
 ssize_t k_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t k_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 int k_close(int sockfd);
-int dropMessage(float prob);
+ssize_t k_sendmsg(int sockfd, const struct msghdr *msg, int flags);
+ssize_t k_recvmsg(int sockfd, struct msghdr *msg, int flags);
+int k_sendmmsg(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags);
+int k_recvmmsg(int sockfd, struct k_mmsghdr *msgvec, unsigned int vlen, int flags);
+void *k_send_reserve(int sockfd, int flags);
+int k_send_commit(int sockfd, size_t len);
+const void *k_recv_peek(int sockfd, size_t *len, int flags);
+int k_recv_release(int sockfd);
+ssize_t k_write(int sockfd, const void *buf, size_t len);
+ssize_t k_read(int sockfd, void *buf, size_t len);
+int k_set_nodelay(int sockfd, int nodelay);
+void lock_socket(int sockfd);
+void complete_request(int sockfd);
+void unlock_socket(int sockfd);
+int mark_tx_pending(int sockfd);
+int flush_stream_segment(int sockfd, SOCKET_BUFFERS *bufs);
+int64_t monotonic_ns(void);
+size_t socket_buffers_size(int send_size, int recv_size, int unconnected);
+SOCKET_BUFFERS *socket_buffers(int sockfd);
+void release_socket_buffers(int sockfd);
+void ring_doorbell(int sockfd);
+SHARED_MEMORY *peer_state(int sockfd);
+int find_peer(int sockfd, const struct sockaddr_in *addr);
+int open_peer(int sockfd, const struct sockaddr_in *addr);
+void release_peers(int sockfd);
+int expire_peers(int sockfd, int64_t now);
+int k_set_congestion(int sockfd, int algorithm);
+int k_set_timeout(int sockfd, int recv_timeout_ms, int send_timeout_ms);
+int k_set_ack_delay(int sockfd, int delay_us);
+int k_get_stats(int sockfd, struct ktp_stats *stats);
+int k_set_impairment(int sockfd, const struct ktp_impairment *impairment);
+int k_get_impairment(int sockfd, struct ktp_impairment *impairment);
+void impairment_defaults(struct ktp_impairment *impairment);
+int k_parse_impairment(char *spec, struct ktp_impairment *impairment);
+void reset_impairment(int sockfd);
+void stats_write_begin(int sockfd);
+void stats_write_end(int sockfd);
+void wake_socket_event(uint32_t *event);
+
+// Entry of a KTP socket or peer (caller holds its lock, as for socket_buffers())
+static inline SHARED_MEMORY *socket_state(int sockfd) {
+    return IS_PEER(sockfd) ? peer_state(sockfd) : &shared_mem[sockfd];
+}
+
+// Counters of a KTP socket; the peers of an unconnected socket count in its own
+#define SOCKET_STATS(sockfd) (&shared_mem[PARENT_SOCKET(sockfd)].stats)
+
+// Congestion control (congestion.c), called with the socket lock held
+void cc_init(struct cong_info *cc, int algorithm);
+const char *cc_name(int algorithm);
+int cc_window(const struct cong_info *cc);
+void cc_on_sent(struct cong_info *cc, uint32_t seq_num);
+void cc_on_ack(struct cong_info *cc, uint32_t snd_una, int acked, int sacked, int64_t srtt);
+void cc_on_loss(struct cong_info *cc, uint32_t snd_una);
+void cc_on_timeout(struct cong_info *cc, uint32_t snd_una);
 
 #endif // KSOCKET_H
@@ -0,0 +1,379 @@
+/*===========================================
+ Assignment 4: Emulating End-to-End Reliable Flow Control
+ Name: Aritra Maji
+ Roll number: 22CS30011
+============================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "ksocket.h"
+
+#define BENCH_IP "127.0.0.1"
+#define BENCH_TIMEOUT_MS 30000  // A connection that stalls this long fails the run
+#define MAX_CONNECTIONS (N / 2) // Each connection takes two KTP sockets
+
+// Benchmark settings from the command line
+struct bench_config {
+    int bulk;              // 1 to run the bulk transfer
+    int pingpong;          // 1 to run the ping-pong latency test
+    int connections;       // Concurrent socket pairs, each a client and a server process
+    int messages;          // Messages per connection in the bulk transfer
+    int round_trips;       // Round trips per connection in the ping-pong test
+    int size;              // Bytes per message
+    int base_port;         // Connection i uses base_port + 2i (server) and + 2i + 1 (client)
+    struct ktp_impairment impairment;  // Set on both sockets of every connection
+};
+
+// What a client process reports to the parent through its pipe, followed by the
+// latency of every round trip in the ping-pong test
+struct bench_result {
+    int ok;                // 0 if the connection failed
+    int64_t start;         // CLOCK_MONOTONIC ns when the first message was sent
+    int64_t end;           // ... and when the last one was known to have arrived
+    long messages;         // Messages delivered
+    int samples;           // Round-trip latencies that follow (ns each)
+};
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-m bulk|pingpong|all] [-c connections] [-n messages] [-r round_trips]\n"
+           "       [-s size] [-p base_port] [-I impairment]\n", prog);
+    printf("Runs between processes on %s through a running initksocket and prints JSON.\n", BENCH_IP);
+    printf("At most %d connections; -s may exceed %d bytes up to what the buffers hold.\n",
+           MAX_CONNECTIONS, MAX_MSG_SIZE);
+    printf("-I sets the impairment of both sockets of every connection (default none):\n");
+    printf("  loss=P  gilbert=p:r:bad_loss  duplicate=P  reorder=P:gap_us  delay=us  jitter=us\n");
+    printf("  rate=kbps  seed=N  none (no impairment at all)\n");
+}
+
+// Open and bind the KTP socket of this process; returns -1 on failure
+static int open_bench_socket(int port, int peer_port, const struct ktp_impairment *impairment) {
+    int sockfd = k_socket(AF_INET, SOCK_KTP, 0);
+    if (sockfd < 0) {
+        perror("k_socket");
+        return -1;
+    }
+    if (k_bind(BENCH_IP, port, BENCH_IP, peer_port) < 0 ||
+        k_set_timeout(sockfd, BENCH_TIMEOUT_MS, BENCH_TIMEOUT_MS) < 0) {
+        perror("k_bind");
+        k_close(sockfd);
+        return -1;
+    }
+    if (k_set_impairment(sockfd, impairment) < 0) {
+        perror("k_set_impairment");
+        k_close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Send one message of len bytes to the peer; returns -1 on failure
+static int send_message(int sockfd, const char *buf, int len, int peer_port) {
+    struct sockaddr_in dest_addr;
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(peer_port);
+    inet_pton(AF_INET, BENCH_IP, &dest_addr.sin_addr);
+    if (k_sendto(sockfd, buf, len, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+        perror("k_sendto");
+        return -1;
+    }
+    return 0;
+}
+
+// Receive one message into buf; returns -1 on failure or timeout
+static int recv_message(int sockfd, char *buf, int len) {
+    if (k_recvfrom(sockfd, buf, len, 0, NULL, NULL) < 0) {
+        perror("k_recvfrom");
+        return -1;
+    }
+    return 0;
+}
+
+/* Server side of a connection: take the bulk messages and confirm the last one, then
+ * echo the ping-pong messages. Waits on start until every connection is set up */
+static int run_server(const struct bench_config *config, int conn, int ready_fd, int start_fd) {
+    int port = config->base_port + 2 * conn;
+    int sockfd = open_bench_socket(port, port + 1, &config->impairment);
+    char *buf = malloc(config->size);
+    char go;
+    int ok = (sockfd >= 0 && buf != NULL);
+    if (write(ready_fd, &ok, sizeof(ok)) != sizeof(ok) || !ok ||
+        read(start_fd, &go, 1) != 1) {
+        return 1;
+    }
+
+    if (config->bulk) {
+        for (int msg_idx = 0; msg_idx < config->messages && ok; msg_idx++) {
+            ok = (recv_message(sockfd, buf, config->size) == 0);
+        }
+        ok = ok && send_message(sockfd, buf, 1, port + 1) == 0;
+    }
+    if (config->pingpong) {
+        for (int trip = 0; trip < config->round_trips && ok; trip++) {
+            ok = (recv_message(sockfd, buf, config->size) == 0 &&
+                  send_message(sockfd, buf, config->size, port + 1) == 0);
+        }
+    }
+    k_close(sockfd);
+    return ok ? 0 : 1;
+}
+
+// Write all of len bytes to a pipe
+static int write_all(int fd, const void *data, size_t len) {
+    const char *bytes = data;
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if (written <= 0) {
+            return -1;
+        }
+        bytes += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Read all of len bytes from a pipe
+static int read_all(int fd, void *data, size_t len) {
+    char *bytes = data;
+    while (len > 0) {
+        ssize_t got = read(fd, bytes, len);
+        if (got <= 0) {
+            return -1;
+        }
+        bytes += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/* Client side of a connection: time the bulk transfer from the first message sent to
+ * the server's confirmation of the last, then time every ping-pong round trip. The
+ * results go to the parent through result_fd, bulk first */
+static int run_client(const struct bench_config *config, int conn, int ready_fd, int start_fd, int result_fd) {
+    int peer_port = config->base_port + 2 * conn;
+    int sockfd = open_bench_socket(peer_port + 1, peer_port, &config->impairment);
+    char *buf = calloc(1, config->size);
+    int64_t *samples = malloc((config->round_trips + 1) * sizeof(int64_t));
+    char go;
+    int ok = (sockfd >= 0 && buf != NULL && samples != NULL);
+    if (write(ready_fd, &ok, sizeof(ok)) != sizeof(ok) || !ok ||
+        read(start_fd, &go, 1) != 1) {
+        return 1;
+    }
+
+    struct bench_result result;
+    if (config->bulk) {
+        memset(&result, 0, sizeof(result));
+        result.start = monotonic_ns();
+        for (int msg_idx = 0; msg_idx < config->messages && ok; msg_idx++) {
+            memcpy(buf, &msg_idx, sizeof(msg_idx) < (size_t)config->size ? sizeof(msg_idx) : (size_t)config->size);
+            ok = (send_message(sockfd, buf, config->size, peer_port) == 0);
+            result.messages += ok;
+        }
+        ok = ok && recv_message(sockfd, buf, config->size) == 0;
+        result.end = monotonic_ns();
+        result.ok = ok;
+        write_all(result_fd, &result, sizeof(result));
+    }
+    if (config->pingpong) {
+        memset(&result, 0, sizeof(result));
+        result.start = monotonic_ns();
+        for (int trip = 0; trip < config->round_trips && ok; trip++) {
+            int64_t sent_at = monotonic_ns();
+            ok = (send_message(sockfd, buf, config->size, peer_port) == 0 &&
+                  recv_message(sockfd, buf, config->size) == 0);
+            if (ok) {
+                samples[result.samples++] = monotonic_ns() - sent_at;
+                result.messages++;
+            }
+        }
+        result.end = monotonic_ns();
+        result.ok = ok;
+        write_all(result_fd, &result, sizeof(result));
+        write_all(result_fd, samples, result.samples * sizeof(int64_t));
+    }
+    k_close(sockfd);
+    return ok ? 0 : 1;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    int64_t diff = *(const int64_t *)a - *(const int64_t *)b;
+    return (diff > 0) - (diff < 0);
+}
+
+// Latency at quantile q of sorted samples, in microseconds (nearest rank)
+static double quantile_us(const int64_t *sorted, long count, double q) {
+    long rank = (long)(q * count + 0.999999);
+    rank = (rank < 1) ? 1 : (rank > count ? count : rank);
+    return sorted[rank - 1] / 1e3;
+}
+
+// Print the aggregate of one test over all connections as a JSON object
+static void print_results(const char *name, const struct bench_result *results, int connections,
+                          int size, int64_t *samples, long sample_count, int last) {
+    int64_t start = INT64_MAX, end = 0;
+    long messages = 0;
+    int failed = 0;
+    for (int conn = 0; conn < connections; conn++) {
+        start = (results[conn].start < start) ? results[conn].start : start;
+        end = (results[conn].end > end) ? results[conn].end : end;
+        messages += results[conn].messages;
+        failed += !results[conn].ok;
+    }
+    double elapsed = (end > start) ? (end - start) / 1e9 : 0;
+    double rate = (elapsed > 0) ? messages / elapsed : 0;
+
+    printf("  \"%s\": {\n", name);
+    printf("    \"failed_connections\": %d,\n", failed);
+    printf("    \"elapsed_s\": %.6f,\n", elapsed);
+    printf("    \"messages\": %ld,\n", messages);
+    printf("    \"messages_per_s\": %.1f,\n", rate);
+    printf("    \"mb_per_s\": %.3f,\n", rate * size / 1e6);
+    printf("    \"per_connection_messages_per_s\": [");
+    for (int conn = 0; conn < connections; conn++) {
+        double conn_elapsed = (results[conn].end - results[conn].start) / 1e9;
+        printf("%s%.1f", conn ? ", " : "", conn_elapsed > 0 ? results[conn].messages / conn_elapsed : 0);
+    }
+    printf("]");
+
+    if (samples != NULL) {
+        double sum = 0;
+        qsort(samples, sample_count, sizeof(int64_t), compare_ns);
+        for (long sample = 0; sample < sample_count; sample++) {
+            sum += samples[sample];
+        }
+        printf(",\n    \"latency_us\": {");
+        if (sample_count > 0) {
+            printf("\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f",
+                   samples[0] / 1e3, sum / sample_count / 1e3, quantile_us(samples, sample_count, 0.50),
+                   quantile_us(samples, sample_count, 0.99), quantile_us(samples, sample_count, 0.999),
+                   samples[sample_count - 1] / 1e3);
+        }
+        printf("}");
+    }
+    printf("\n  }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config config = {
+        .bulk = 1, .pingpong = 1, .connections = 1, .messages = 10000,
+        .round_trips = 2000, .size = MAX_MSG_SIZE, .base_port = 9500,
+    };
+    impairment_defaults(&config.impairment);
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:n:r:s:p:I:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                config.bulk = (strcmp(optarg, "bulk") == 0 || strcmp(optarg, "all") == 0);
+                config.pingpong = (strcmp(optarg, "pingpong") == 0 || strcmp(optarg, "all") == 0);
+                break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'n': config.messages = atoi(optarg); break;
+            case 'r': config.round_trips = atoi(optarg); break;
+            case 's': config.size = atoi(optarg); break;
+            case 'p': config.base_port = atoi(optarg); break;
+            case 'I':
+                if (k_parse_impairment(optarg, &config.impairment) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if ((!config.bulk && !config.pingpong) || config.connections < 1 ||
+        config.connections > MAX_CONNECTIONS || config.messages < 1 || config.round_trips < 1 ||
+        config.size < 1 || config.size > MAX_MESSAGE_SIZE || config.base_port < 1 ||
+        config.base_port + 2 * config.connections > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Every process binds a socket of its own; the parent only starts and collects them
+    int ready_pipe[2], start_pipe[2], result_pipes[MAX_CONNECTIONS][2];
+    if (pipe(ready_pipe) < 0 || pipe(start_pipe) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    for (int conn = 0; conn < config.connections; conn++) {
+        if (pipe(result_pipes[conn]) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        for (int side = 0; side < 2; side++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                close(start_pipe[1]);
+                exit(side == 0 ? run_server(&config, conn, ready_pipe[1], start_pipe[0])
+                               : run_client(&config, conn, ready_pipe[1], start_pipe[0],
+                                            result_pipes[conn][1]));
+            }
+        }
+        close(result_pipes[conn][1]);
+    }
+    close(start_pipe[0]);
+
+    // Start all connections together once every socket is bound
+    int all_ready = 1;
+    for (int proc = 0; proc < 2 * config.connections; proc++) {
+        int ok = 0;
+        if (read(ready_pipe[0], &ok, sizeof(ok)) != sizeof(ok)) {
+            ok = 0;
+        }
+        all_ready &= ok;
+    }
+    if (all_ready) {
+        char go[2 * MAX_CONNECTIONS] = {0};
+        write_all(start_pipe[1], go, 2 * config.connections);
+    }
+    close(start_pipe[1]);
+
+    struct bench_result bulk[MAX_CONNECTIONS], pingpong[MAX_CONNECTIONS];
+    int64_t *samples = malloc((size_t)config.connections * config.round_trips * sizeof(int64_t));
+    long sample_count = 0;
+    memset(bulk, 0, sizeof(bulk));
+    memset(pingpong, 0, sizeof(pingpong));
+    for (int conn = 0; conn < config.connections && all_ready; conn++) {
+        int fd = result_pipes[conn][0];
+        if (config.bulk && read_all(fd, &bulk[conn], sizeof(bulk[conn])) < 0) {
+            continue;
+        }
+        if (config.pingpong && read_all(fd, &pingpong[conn], sizeof(pingpong[conn])) == 0 &&
+            read_all(fd, samples + sample_count, pingpong[conn].samples * sizeof(int64_t)) == 0) {
+            sample_count += pingpong[conn].samples;
+        }
+    }
+    int status, failed = !all_ready;
+    while (wait(&status) > 0) {
+        failed |= !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    printf("{\n");
+    printf("  \"connections\": %d,\n", config.connections);
+    printf("  \"message_size\": %d,\n", config.size);
+    const struct ktp_impairment *impairment = &config.impairment;
+    const char *loss_models[] = { "none", "bernoulli", "gilbert" };
+    printf("  \"impairment\": {\"loss_model\": \"%s\", \"loss\": %g, \"gilbert_p\": %g, \"gilbert_r\": %g, "
+           "\"gilbert_loss_bad\": %g, \"duplicate\": %g, \"reorder\": %g, \"reorder_gap_us\": %d, "
+           "\"delay_us\": %d, \"jitter_us\": %d, \"rate_kbps\": %d, \"seed\": %llu},\n",
+           loss_models[impairment->loss_model], impairment->loss, impairment->gilbert_p, impairment->gilbert_r,
+           impairment->gilbert_loss_bad, impairment->duplicate, impairment->reorder, impairment->reorder_gap_us,
+           impairment->delay_us, impairment->jitter_us, impairment->rate_kbps,
+           (unsigned long long)impairment->seed);
+    printf("  \"ok\": %s%s\n", failed ? "false" : "true", (config.bulk || config.pingpong) ? "," : "");
+    if (config.bulk) {
+        print_results("bulk", bulk, config.connections, config.size, NULL, 0, !config.pingpong);
+    }
+    if (config.pingpong) {
+        print_results("pingpong", pingpong, config.connections, config.size, samples, sample_count, 1);
+    }
+    printf("}\n");
+    return failed ? 1 : 0;
+}
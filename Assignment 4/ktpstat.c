@@ -0,0 +1,112 @@
+/*===========================================
+ Assignment 4: Emulating End-to-End Reliable Flow Control
+ Name: Aritra Maji
+ Roll number: 22CS30011
+============================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ksocket.h"
+
+// Print the counters of every KTP socket, like ss -i does for TCP, once or every
+// interval seconds. Snapshots are taken through the seqlock of each socket, so
+// neither initksocket nor the applications ever wait for ktpstat
+static void usage(const char *prog) {
+    printf("Usage: %s [-i <seconds>] [socket]\n", prog);
+    printf("  -i <seconds>  Print again every interval, with rates over the last one\n");
+    printf("  socket        Only print this KTP socket\n");
+}
+
+// Describe whom a socket talks to; set-up fields only change while the slot is free
+static void describe_socket(int sockfd, char *text, size_t size) {
+    struct sock_info info = shared_mem[sockfd].sock_info;
+    info.ip_addr[INET_ADDRSTRLEN - 1] = '\0';
+    if (info.unconnected) {
+        snprintf(text, size, "unconnected, %d peers", info.peers - info.free_peers);
+    } else if (info.ip_addr[0] != '\0') {
+        snprintf(text, size, "%s:%d", info.ip_addr, info.port);
+    } else {
+        snprintf(text, size, "unbound");
+    }
+    size_t used = strlen(text);
+    snprintf(text + used, size - used, " %s pid %d worker %d",
+             info.stream ? "stream" : "dgram", (int)info.pid, info.worker);
+}
+
+// Print one socket; rates are per second over interval if last is given
+static void print_socket(int sockfd, const struct ktp_stats *stats, const struct ktp_stats *last, double interval) {
+    char peer[INET_ADDRSTRLEN + 64];
+    describe_socket(sockfd, peer, sizeof(peer));
+    printf("KTP %d %s\n", sockfd, peer);
+    printf("\tsent %llu pkts %llu bytes retrans %llu | received %llu pkts %llu bytes dup %llu drops %llu\n",
+           (unsigned long long)stats->packets_sent, (unsigned long long)stats->bytes_sent,
+           (unsigned long long)stats->retransmits, (unsigned long long)stats->packets_received,
+           (unsigned long long)stats->bytes_received, (unsigned long long)stats->duplicates,
+           (unsigned long long)stats->drops);
+    printf("\tacks sent %llu received %llu dupacks %llu | zero_window %llu enospace %llu enomessage %llu\n",
+           (unsigned long long)stats->acks_sent, (unsigned long long)stats->acks_received,
+           (unsigned long long)stats->dupacks, (unsigned long long)stats->zero_windows,
+           (unsigned long long)stats->enospace, (unsigned long long)stats->enomessage);
+    printf("\tsrtt %.3fms rto %.3fms cwnd %d", stats->srtt / 1e6, stats->rto / 1e6, stats->cwnd);
+    if (last != NULL) {
+        printf(" | send %.1f pkt/s %.1f KB/s receive %.1f pkt/s %.1f KB/s",
+               (stats->packets_sent - last->packets_sent) / interval,
+               (stats->bytes_sent - last->bytes_sent) / interval / 1024,
+               (stats->packets_received - last->packets_received) / interval,
+               (stats->bytes_received - last->bytes_received) / interval / 1024);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int interval = 0, only = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:h")) != -1) {
+        if (opt == 'i' && atoi(optarg) > 0) {
+            interval = atoi(optarg);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        only = atoi(argv[optind]);
+        if (only < 0 || only >= N) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Counters of the last round, to turn them into rates; a reused slot starts over
+    struct ktp_stats last[N];
+    int seen[N] = {0};
+    while (1) {
+        int shown = 0;
+        for (int sockfd = 0; sockfd < N; sockfd++) {
+            struct ktp_stats stats;
+            if ((only >= 0 && sockfd != only) || k_get_stats(sockfd, &stats) < 0) {
+                seen[sockfd] = 0;
+                continue;
+            }
+            int fresh = seen[sockfd] && stats.packets_sent >= last[sockfd].packets_sent &&
+                        stats.packets_received >= last[sockfd].packets_received;
+            print_socket(sockfd, &stats, fresh ? &last[sockfd] : NULL, interval);
+            last[sockfd] = stats;
+            seen[sockfd] = 1;
+            shown++;
+        }
+        if (shown == 0) {
+            printf("No KTP sockets open\n");
+        }
+
+        if (interval == 0) {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+        sleep(interval);
+    }
+    return 0;
+}
@@ -11,6 +11,7 @@
 #include "ksocket.h"
 
 #define BUFSIZE MAX_MSG_SIZE
+#define BATCH 16        // Messages queued per k_sendmmsg call
 
 int main(int argc, char *argv[]) {
     if (argc != 5) {
@@ -55,27 +56,42 @@ int main(int argc, char *argv[]) {
     }
     printf("File opened successfully. Starting transfer...\n");
     
-    // Send file content
-    char buffer[BUFSIZE];
+    // Send file content, BATCH messages per read() and per k_sendmmsg() call
+    static char buffer[BATCH * BUFSIZE + 1];
+    struct iovec iovs[BATCH + 1];
+    struct k_mmsghdr msgs[BATCH + 1];
     int packet_count = 0;
-    int read_bytes, sent_bytes;
+    int read_bytes;
     
-    while ((read_bytes = read(fd, buffer, BUFSIZE)) > 0) {
-        printf("Sending %d bytes in packet #%d...\n", read_bytes, packet_count + 1);
+    while ((read_bytes = read(fd, buffer, BATCH * BUFSIZE)) > 0) {
+        // One message per BUFSIZE bytes, the last one possibly shorter
+        int msg_count = 0;
+        for (int offset = 0; offset < read_bytes; offset += BUFSIZE) {
+            iovs[msg_count].iov_base = buffer + offset;
+            iovs[msg_count].iov_len = (read_bytes - offset < BUFSIZE) ? read_bytes - offset : BUFSIZE;
+            msg_count++;
+        }
         
-        // Try to send until successful
-        while ((sent_bytes = k_sendto(sockfd, buffer, read_bytes, 0, 
-                           (struct sockaddr *)&dest_addr, sizeof(dest_addr))) < 0) {
-            if (errno == ENOSPACE) {
-                printf("Send buffer full, waiting for space...\n");
-                sleep(1);
-                continue;
+        // Queue the messages with one lock round trip per call
+        for (int sent = 0; sent < msg_count; ) {
+            for (int msg_idx = sent; msg_idx < msg_count; msg_idx++) {
+                memset(&msgs[msg_idx].msg_hdr, 0, sizeof(msgs[msg_idx].msg_hdr));
+                msgs[msg_idx].msg_hdr.msg_name = &dest_addr;
+                msgs[msg_idx].msg_hdr.msg_namelen = sizeof(dest_addr);
+                msgs[msg_idx].msg_hdr.msg_iov = &iovs[msg_idx];
+                msgs[msg_idx].msg_hdr.msg_iovlen = 1;
+            }
+            
+            // Blocks while the send buffer is full
+            int queued = k_sendmmsg(sockfd, msgs + sent, msg_count - sent, 0);
+            if (queued < 0) {
+                perror("Error in sending data");
+                exit(1);
             }
-            perror("Error in sending data");
-            exit(1);
+            sent += queued;
+            packet_count += queued;
+            printf("Queued %d packets, %d so far\n", queued, packet_count);
         }
-        
-        printf("Sent %d bytes successfully! Packet #%d complete.\n", sent_bytes, ++packet_count);
     }
     
     if (read_bytes < 0) {
@@ -85,13 +101,12 @@ int main(int argc, char *argv[]) {
     
     // Send EOF marker
     buffer[0] = '#';  // Using '#' as EOF marker
-    while ((sent_bytes = k_sendto(sockfd, buffer, 1, 0, 
-                       (struct sockaddr *)&dest_addr, sizeof(dest_addr))) < 0) {
-        if (errno == ENOSPACE) {
-            printf("Send buffer full, waiting for space to send EOF...\n");
-            sleep(1);
-            continue;
-        }
+    struct iovec eof_iov = { buffer, 1 };
+    struct msghdr eof_msg;
+    memset(&eof_msg, 0, sizeof(eof_msg));
+    eof_msg.msg_iov = &eof_iov;
+    eof_msg.msg_iovlen = 1;   // No msg_name: the bound destination
+    if (k_sendmsg(sockfd, &eof_msg, 0) < 0) {
         perror("Error in sending EOF");
         exit(1);
     }
@@ -102,11 +117,7 @@ int main(int argc, char *argv[]) {
     // Close file
     close(fd);
     
-    // Give some time for the last packet to be processed
-    printf("Waiting for final acknowledgments...\n");
-    sleep(10);
-    
-    // Close socket
+    // Close socket; k_close waits for the final acknowledgments
     if (k_close(sockfd) < 0) {
         perror("Error closing socket");
         exit(1);
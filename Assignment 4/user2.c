@@ -9,9 +9,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include "ksocket.h"
 
 #define BUFSIZE MAX_MSG_SIZE
+#define BATCH 16        // Most messages taken per k_recvmmsg call
 
 int main(int argc, char *argv[]) {
     if (argc != 5) {
@@ -53,45 +55,52 @@ int main(int argc, char *argv[]) {
     }
     printf("Output file '%s' created. Waiting for data...\n", filename);
     
-    // Prepare source address structure
-    struct sockaddr_in src_addr;
-    socklen_t addrlen = sizeof(src_addr);
-    
-    // Receive and write file
-    char buffer[BUFSIZE];
+    // Receive and write file, up to BATCH messages per k_recvmmsg() and writev() call
+    static char buffers[BATCH][BUFSIZE];
+    struct iovec iovs[BATCH];
+    struct k_mmsghdr msgs[BATCH];
     int packet_count = 0;
     int total_bytes = 0;
-    int recv_bytes;
+    int eof = 0;
     
-    while (1) {
-        // Try to receive data
-        while ((recv_bytes = k_recvfrom(sockfd, buffer, BUFSIZE, 0,
-                            (struct sockaddr *)&src_addr, &addrlen)) < 0) {
-            if (errno == ENOMESSAGE) {
-                // No message available, wait and try again
-                usleep(100000); // 100ms
-                continue;
-            }
+    while (!eof) {
+        for (int msg_idx = 0; msg_idx < BATCH; msg_idx++) {
+            iovs[msg_idx].iov_base = buffers[msg_idx];
+            iovs[msg_idx].iov_len = BUFSIZE;
+            memset(&msgs[msg_idx].msg_hdr, 0, sizeof(msgs[msg_idx].msg_hdr));
+            msgs[msg_idx].msg_hdr.msg_iov = &iovs[msg_idx];
+            msgs[msg_idx].msg_hdr.msg_iovlen = 1;
+        }
+        
+        // Blocks until the next message arrives, then takes every one already waiting
+        int received = k_recvmmsg(sockfd, msgs, BATCH, 0);
+        if (received < 0) {
             perror("Error in receiving data");
             exit(1);
         }
         
-        printf("Received %d bytes in packet #%d\n", recv_bytes, ++packet_count);
-        
-        // Check for EOF
-        if (recv_bytes == 1 && buffer[0] == '#') {
-            printf("Received EOF marker. File transfer complete!\n");
-            break;
+        // Write the messages before an EOF marker with one system call
+        int data_msgs = 0, batch_bytes = 0;
+        for (int msg_idx = 0; msg_idx < received; msg_idx++) {
+            packet_count++;
+            if (msgs[msg_idx].msg_len == 1 && buffers[msg_idx][0] == '#') {
+                printf("Received EOF marker. File transfer complete!\n");
+                eof = 1;
+                break;
+            }
+            iovs[msg_idx].iov_len = msgs[msg_idx].msg_len;
+            batch_bytes += msgs[msg_idx].msg_len;
+            data_msgs++;
         }
+        printf("Received %d packets (%d bytes), %d so far\n", received, batch_bytes, packet_count);
         
-        // Write to file
-        if (write(fd, buffer, recv_bytes) != recv_bytes) {
+        if (data_msgs > 0 && writev(fd, iovs, data_msgs) != batch_bytes) {
             perror("Error writing to file");
             exit(1);
         }
         
-        total_bytes += recv_bytes;
-        printf("Wrote %d bytes to file. Total bytes received: %d\n", recv_bytes, total_bytes);
+        total_bytes += batch_bytes;
+        printf("Wrote %d bytes to file. Total bytes received: %d\n", batch_bytes, total_bytes);
     }
     
     // Close file